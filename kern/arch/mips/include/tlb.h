@@ -53,20 +53,28 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   tlb_setpid: load ENTRYHI without touching the TLB. Only its PID
+ *        field matters: that is the address space ID the processor
+ *        matches TLB entries against. All of the above leave ENTRYHI
+ *        set to whatever they were passed, so the PID of the running
+ *        address space has to be put back after using them with
+ *        anything else.
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setpid(uint32_t entryhi);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID. We tag
+ * user entries with it (TLBHI_PID), so switching address spaces does
+ * not have to flush the TLB. TLBLO_GLOBAL is left always zero, as are
+ * the bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +86,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -101,5 +110,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs.
+ */
+
+#define NUM_ASID 64
+
 
 #endif /* _MIPS_TLB_H_ */
@@ -111,11 +111,11 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space of the page, NULL if unknown */
+	vaddr_t ts_vaddr;		/* user page to invalidate */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
@@ -66,6 +67,19 @@ static const char *const trapcodenames[NTRAPCODES] = {
 	"Arithmetic overflow",
 };
 
+/*
+ * A process the OOM killer picked exits here, on its way back to user
+ * mode. Interrupts have to be on (at the thread's level).
+ */
+static
+void
+check_killed(void)
+{
+	if (curproc->p_killed) {
+		sys_exit(SIGKILL);
+	}
+}
+
 /*
  * Function called when user-level code hits a fatal fault.
  */
@@ -194,6 +208,13 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/* A killed process spinning in user mode dies here */
+		if (!iskern && curproc->p_killed) {
+			spl = splhigh();
+			splx(spl);
+			check_killed();
+		}
 		goto done2;
 	}
 
@@ -268,9 +289,11 @@ mips_trap(struct trapframe *tf)
 
 	if (!iskern) {
 		/*
-		 * Fatal fault in user mode.
-		 * Kill the current user process.
+		 * Fatal fault in user mode. If the OOM killer took the
+		 * memory the fault needed, that's what we die of;
+		 * otherwise kill the current user process.
 		 */
+		check_killed();
 		kill_curthread(tf->tf_epc, code, tf->tf_vaddr);
 		goto done;
 	}
@@ -314,6 +337,10 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	if (!iskern) {
+		check_killed();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -152,6 +152,38 @@ syscall(struct trapframe *tf)
 		retval = (int) sbrk__(tf->tf_a0, &err);
 		break;
 
+	    case SYS_mmap:
+		err = sys_mmap(tf, &retval);
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap(tf, &retval);
+		break;
+
+	    case SYS___vmstat:
+		err = sys___vmstat((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS_sched_setaffinity:
+		err = sys_sched_setaffinity((pid_t)tf->tf_a0,
+					    (uint32_t)tf->tf_a1);
+		break;
+
+	    case SYS_sched_getaffinity:
+		err = sys_sched_getaffinity((pid_t)tf->tf_a0,
+					    (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_sched_settickets:
+		err = sys_sched_settickets((pid_t)tf->tf_a0,
+					   (unsigned)tf->tf_a1);
+		break;
+
+	    case SYS_sched_gettickets:
+		err = sys_sched_gettickets((pid_t)tf->tf_a0,
+					   (userptr_t)tf->tf_a1);
+		break;
+
 
 		// File I/O
 	    case SYS_open:
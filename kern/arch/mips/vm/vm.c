@@ -10,86 +10,218 @@
 #include <proc.h>
 #include <coremap.h>
 #include <diskmap.h>
+#include <cpu.h>
+#include <thread.h>
+#include <uio.h>
+#include <vnode.h>
+#include <pagetable.h>
+#include <stat.h>
+#include <vmstat.h>
+
+/* Number of frames moved between a cpu's magazine and the coremap at once */
+#define FRAME_BATCH (CPU_FRAME_MAGAZINE / 2)
+
+/* Most pages paged in by one fault, counting the faulting page */
+#define VM_FAULTAHEAD 8
+
+/* Rounds vm_alloc_page waits for frames, before and after an OOM kill */
+#define VM_ALLOC_WAITS 8
+
+/* Dirty pages the pageout daemon writes out ahead of eviction per pass */
+#define VM_CLEAN_PAGES (PAGEOUT_HIGH - PAGEOUT_LOW)
+
+/*
+ * Large pages: aligned groups of VM_LPAGE_PAGES pages in heaps of at
+ * least VM_LPAGE_MINHEAP bytes, see vm_in_lpage.
+ */
+#define VM_LPAGE_PAGES 4
+#define VM_LPAGE_SIZE (VM_LPAGE_PAGES * PAGE_SIZE)
+#define VM_LPAGE_MINHEAP (64 * PAGE_SIZE)
+
+/* The address space ID in an ASID; the bits above count generations */
+#define ASID_MASK (NUM_ASID - 1)
+
+static int pageout_thread(void *data1, unsigned long data2);
+
+/*
+ * The zero frame. Never written anonymous pages (heap, stack, BSS and
+ * anonymous mappings) that are read are all mapped to it, read-only,
+ * until they are written. It is a kernel page, so the coremap never
+ * hands it to the pageout code, and nobody frees it.
+ */
+static vaddr_t vm_zero_frame;
 
 void
 vm_bootstrap(void)
 {
+	int result;
+
 	//coremap_bootstrap();
+	pagezero_bootstrap();
+	pageout_bootstrap();
+
+	vm_zero_frame = alloc_kpages(1);
+	if (vm_zero_frame == 0) {
+		panic("vm_bootstrap: no memory for the zero frame\n");
+	}
+	bzero((void *)vm_zero_frame, PAGE_SIZE);
+
+	result = thread_fork("pageout", NULL, NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("vm_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Per-cpu frame magazines. A frame sitting in a magazine is off the
+ * buddy lists and marked as an occupied kernel page without references,
+ * so nobody else looks at it. The cpu owning the magazine can then hand
+ * it out or take it back without the coremap lock. Frames in magazines
+ * count as in use for the coremap bookkeeping.
+ *
+ * Both functions must be called with interrupts off.
+ */
+static
+void
+magazine_refill(struct cpu *c)
+{
+	unsigned int page_index;
+
+	acquire_cm_lock();
+	while (c->c_numframes < FRAME_BATCH && get_free_page(&page_index)) {
+		set_occupied(page_index);
+		set_kernel_page(page_index);
+		// set_occupied hands out the first reference; we don't want it yet
+		dec_refcount(page_index);
+		c->c_frames[c->c_numframes++] = page_index;
+	}
+	release_cm_lock();
+}
+
+static
+void
+magazine_drain(struct cpu *c, unsigned int keep)
+{
+	acquire_cm_lock();
+	while (c->c_numframes > keep) {
+		set_free(c->c_frames[--c->c_numframes]);
+	}
+	release_cm_lock();
 }
 
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(int npages)
 {
-	acquire_cm_lock();
-
 	vaddr_t page_addr = (vaddr_t)NULL;
 	unsigned int  page_index;
 	bool ret = false;
 
-	// for simplicity we only allow to allocate one pace per call
-	KASSERT(npages == 1);
+	KASSERT(npages > 0);
+
+	// single pages come out of this cpu's magazine, once we have cpus
+	if (npages == 1 && CURCPU_EXISTS() && curcpu != NULL) {
+		int spl = splhigh();
+		struct cpu *c = curcpu->c_self;
 
-	// get a free page
-	ret = get_free_page(&page_index);
+		if (c->c_numframes == 0) {
+			magazine_refill(c);
+		}
+		if (c->c_numframes == 0) {
+			splx(spl);
+			return (vaddr_t)NULL;
+		}
+		page_index = c->c_frames[--c->c_numframes];
+		splx(spl);
+
+		// the frame is ours alone, no need for the coremap lock
+		inc_refcount(page_index);
+		set_run_length(page_index, 1);
+		page_addr = get_page_vaddr(page_index);
+		if (!clear_zeroed(page_index)) {
+			bzero((void *)page_addr, PAGE_SIZE);
+		}
+		return page_addr;
+	}
+
+	acquire_cm_lock();
+
+	// get a run of free pages from the buddy allocator
+	ret = get_free_pages(npages, &page_index);
+	if (ret == false && CURCPU_EXISTS() && curcpu != NULL) {
+		// our magazine might be holding the missing pieces
+		release_cm_lock();
+		int spl = splhigh();
+		magazine_drain(curcpu->c_self, 0);
+		splx(spl);
+		acquire_cm_lock();
+		ret = get_free_pages(npages, &page_index);
+	}
 	// return null if no page is available or strange page_index received
 	if (ret == false || page_index <= 0) {		
 		release_cm_lock();
 		return (vaddr_t)NULL;	
 	}
 
- 	// occupy page
-    	set_occupied(page_index);
-
-    	// Additional test
-    	/*
-    	// check if occupying worked
-    	ret = is_free(page_index);
-	if (ret) {		
-		release_cm_lock();
-		return NULL;
+	// occupy the pages and set the kernel flag
+	for (int i = 0; i < npages; i++) {
+		set_occupied(page_index + i);
+		set_kernel_page(page_index + i);
 	}
-	*/
 
-	// Set kernel flag
-    	set_kernel_page(page_index);
-
-    	// Additional tests
-    	/*
-    	// check if kernel flag is set
-    	ret = is_kernel_page(page_index);
-	if (ret == false) {		
-		release_cm_lock();
-		return NULL;
-	}
-	*/
+	// remember the length of the run for free_kpages
+	set_run_length(page_index, npages);
 
 	// get address of page get_page_vaddr returns KVADDR
 	page_addr = get_page_vaddr(page_index);
 
 	release_cm_lock();
 
+	// zero the pages outside of the coremap lock
+	bzero((void *)page_addr, npages * PAGE_SIZE);
+
 	return page_addr;
 }
 
 void
 free_kpages(vaddr_t addr)
 {
-	acquire_cm_lock();
 	int page_index = 0;
 	bool ret = false;
 
 	// check if vaddr_t is in kernel area
-	if(addr < MIPS_KSEG0 || MIPS_KSEG1 <= addr) {
-		release_cm_lock();
-		KASSERT(false);
-	}
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
 
 	// translate KVADDR to VADDR -> happens in get_page_index()
 
 	// get page index
 	page_index = get_page_index(addr);
 
+	// a single page with only our reference can't be shared with anyone
+	// (only its owner can add references in as_copy), so it goes back
+	// into this cpu's magazine without the coremap lock. pages in the
+	// page cache can be picked up by anyone and go the slow way. so do
+	// all pages while memory is short, for others to find them
+	if (get_run_length(page_index) == 1 && get_refcount(page_index) == 1 &&
+	    !pc_is_cached(page_index) && get_free_page_count() >= PAGEOUT_LOW &&
+	    CURCPU_EXISTS() && curcpu != NULL) {
+		int spl = splhigh();
+		struct cpu *c = curcpu->c_self;
+
+		set_kernel_page(page_index);
+		set_lookup(page_index, NULL, NULL, 0);
+		release_swap_slot(page_index);
+		dec_refcount(page_index);
+		if (c->c_numframes == CPU_FRAME_MAGAZINE) {
+			magazine_drain(c, FRAME_BATCH);
+		}
+		c->c_frames[c->c_numframes++] = page_index;
+		splx(spl);
+		return;
+	}
+
+	acquire_cm_lock();
 
 	// page should be in use
  	ret = is_free(page_index);
@@ -98,21 +230,33 @@ free_kpages(vaddr_t addr)
 		KASSERT(false);
 	}
 
-	// page should not be marked as kernel page
-        /*
-    ret = is_kernel_page(page_index);
-	if (ret) {		
-		release_cm_lock();
-		KASSERT(false);
+	// drop our reference. the pages are only freed (and deadbeefed) once
+	// nobody shares them copy-on-write anymore. set_free merges them back
+	// with their buddies
+	if (dec_refcount(page_index)) {
+		unsigned int npages = get_run_length(page_index);
+
+		KASSERT(npages > 0);
+		for (unsigned int i = 0; i < npages; i++) {
+			set_free(page_index + i);
+		}
 	}
-        */
-	// free page and deadbeef it
-	set_free(page_index);
 
 
 	release_cm_lock();
 }
 
+/*
+ * The TLBHI half of a user TLB entry for VADDR in the running address
+ * space.
+ */
+static inline
+uint32_t
+vm_tlbhi(vaddr_t vaddr)
+{
+    return (vaddr & TLBHI_VPAGE) | curcpu->c_tlbpid;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -122,15 +266,1027 @@ vm_tlbshootdown_all(void)
     for (i=0; i<NUM_TLB; i++) {
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
     }
+    tlb_setpid(curcpu->c_tlbpid);
 
     splx(spl);
 }
 
+/*
+ * Invalidate this cpu's translation for ts_vaddr in ts_as. Only the
+ * ASID ts_as has on this cpu can match; if it has none (of the current
+ * generation) there is nothing to do. Without an address space every
+ * entry for the page is dropped, whatever its ASID.
+ */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-    (void)ts;
-    vm_tlbshootdown_all();
+    struct cpu *c;
+    uint32_t entryhi, entrylo, asid;
+    int spl = splhigh();
+    int i;
+
+    c = curcpu->c_self;
+    if (ts->ts_as != NULL) {
+        asid = ts->ts_as->as_asid[c->c_number];
+        if (asid != 0 && ((asid ^ c->c_asid_last) & ~ASID_MASK) == 0) {
+            entryhi = (ts->ts_vaddr & TLBHI_VPAGE) |
+                ((asid & ASID_MASK) << TLBHI_PIDSHIFT);
+            i = tlb_probe(entryhi, 0);
+            if (i >= 0) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+    }
+    else {
+        for (i=0; i<NUM_TLB; i++) {
+            tlb_read(&entryhi, &entrylo, i);
+            if ((entryhi & TLBHI_VPAGE) == (ts->ts_vaddr & TLBHI_VPAGE)) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+    }
+    tlb_setpid(c->c_tlbpid);
+
+    splx(spl);
+}
+
+/*
+ * Only cpus the address space has an ASID on can have its translations:
+ * whatever a cpu still has under an ASID it took away (vm_tlbflush_as)
+ * is never matched again. A cpu that picks up an ASID after we looked
+ * can't load the old translation either, because the page table entry
+ * is marked busy before the shootdown is sent.
+ */
+bool
+vm_tlbshootdown_needed(const struct tlbshootdown *ts, unsigned cpunum)
+{
+    KASSERT(cpunum < MAXCPUS);
+
+    return ts->ts_as == NULL || ts->ts_as->as_asid[cpunum] != 0;
+}
+
+/*
+ * Take VADDR of AS out of every TLB that may have it and wait until
+ * that happened.
+ */
+void
+vm_tlbshootdown_page(struct addrspace *as, vaddr_t vaddr)
+{
+    struct tlbshootdown ts;
+
+    ts.ts_as = as;
+    ts.ts_vaddr = vaddr;
+    vm_tlbshootdown(&ts);
+    ipi_tlbshootdown_sync(&ts);
+}
+
+/*
+ * Switch this cpu's TLB to AS. Its TLB entries are tagged with the
+ * address space ID AS has on this cpu, so whatever it left in the TLB
+ * when it last ran here is still good. An address space that has no
+ * ASID here yet, or one from an older generation, gets the next one.
+ * Once all of them are used up, the TLB is flushed and a new
+ * generation starts, which makes every older ASID stale.
+ */
+void
+vm_tlb_activate(struct addrspace *as)
+{
+    int spl = splhigh();
+    struct cpu *c = curcpu->c_self;
+    uint32_t asid = as->as_asid[c->c_number];
+
+    if (asid == 0 || ((asid ^ c->c_asid_last) & ~ASID_MASK) != 0) {
+        c->c_asid_last++;
+        if ((c->c_asid_last & ASID_MASK) == 0) {
+            vm_tlbshootdown_all();
+            //ASID 0 is never handed out, it marks "none"
+            c->c_asid_last++;
+        }
+        asid = c->c_asid_last;
+        as->as_asid[c->c_number] = asid;
+    }
+
+    c->c_tlbpid = (asid & ASID_MASK) << TLBHI_PIDSHIFT;
+    tlb_setpid(c->c_tlbpid);
+
+    splx(spl);
+}
+
+/*
+ * Make every cpu but this one forget AS's translations: it gets a fresh
+ * ASID there the next time it runs, and the entries under the old one
+ * are never matched again. Used when a mapping of the running address
+ * space is taken away or downgraded.
+ */
+void
+vm_tlbflush_as_others(struct addrspace *as)
+{
+    unsigned i;
+
+    for (i=0; i<MAXCPUS; i++) {
+        if (i != curcpu->c_number) {
+            as->as_asid[i] = 0;
+        }
+    }
+}
+
+/*
+ * Make all cpus, this one included, forget AS's translations.
+ */
+void
+vm_tlbflush_as(struct addrspace *as)
+{
+    int spl = splhigh();
+
+    vm_tlbflush_as_others(as);
+    as->as_asid[curcpu->c_number] = 0;
+    if (proc_getas() == as) {
+        vm_tlb_activate(as);
+    }
+
+    splx(spl);
+}
+
+void
+vm_wait_page(struct page_table_entry *pte)
+{
+    acquire_cm_lock();
+    while (pte->busy) {
+        busy_wait();
+    }
+    release_cm_lock();
+}
+
+/*
+ * Page out a user page to make room. The replacement policy picks the
+ * victim, its translation is taken away from every cpu, it is written
+ * to swap and the owning page table entry is pointed at the swap slot.
+ * A clean page that still has its copy on disk is not written again.
+ * The freed frame is handed to the caller as a zeroed, occupied kernel
+ * page, just like alloc_kpages(1) would. Returns 0 if nothing could be
+ * paged out.
+ */
+vaddr_t
+vm_page_out(void)
+{
+    unsigned int page_index, slot;
+    struct page_table_entry *pte, *prev, *next;
+    struct addrspace *as;
+    struct vnode *v = NULL;
+    vaddr_t vaddr, addr;
+    off_t offset = 0;
+    int near = -1;
+    int result = 0;
+    bool cached;
+
+    acquire_cm_lock();
+    if(!get_swappable_page(&page_index)) {
+        release_cm_lock();
+        return 0;
+    }
+    //pin the frame and tell the owner its page is in transit
+    pte = get_lookup(page_index);
+    as = get_lookup_as(page_index);
+    vaddr = get_lookup_vaddr(page_index);
+    set_busy(page_index, true);
+    pte->busy = 1;
+    //a page from the page cache is a copy of its file. it is dropped instead of
+    //written to swap and read from the file again on the next fault. if it was
+    //written through a shared mapping, it goes back to the file first, and stays
+    //in the cache meanwhile so nobody reads the old contents from the file
+    cached = pc_is_cached(page_index);
+    if(cached) {
+        pc_get_key(page_index, &v, &offset);
+        if(!pte->dirty) {
+            pc_remove(page_index);
+        }
+    }
+    //try to put the page next to its virtual neighbours on disk
+    prev = vaddr >= PAGE_SIZE ? pt_lookup(as, vaddr - PAGE_SIZE) : NULL;
+    next = pt_lookup(as, vaddr + PAGE_SIZE);
+    if(prev != NULL && prev->valid && prev->on_disk) {
+        near = prev->index + 1;
+    } else if(next != NULL && next->valid && next->on_disk && next->index > 0) {
+        near = next->index - 1;
+    }
+    release_cm_lock();
+
+    //nobody may keep writing through an old translation while we write it out.
+    //only the cpus the owner ran on are asked, and we wait for all of them
+    vm_tlbshootdown_page(as, vaddr);
+
+    addr = get_page_vaddr(page_index);
+    if(cached) {
+        KASSERT(get_swap_slot(page_index) < 0);
+        if(pte->dirty) {
+            result = vm_page_write_file(v, offset, addr);
+        }
+    } else if(get_swap_slot(page_index) < 0) {
+        result = write_page(addr, near, &slot);
+    } else {
+        //reuse the disk page we were read from. only write if it changed since
+        slot = get_swap_slot(page_index);
+        if(pte->dirty) {
+            result = write_page_at(slot, addr);
+        }
+    }
+
+    acquire_cm_lock();
+    if(result) {
+        //leave the page where it was
+        pte->busy = 0;
+        set_busy(page_index, false);
+        release_cm_lock();
+        return 0;
+    }
+    if(cached) {
+        //back to never touched
+        pc_remove(page_index);
+        pte->index = 0;
+        pt_set_valid(as, vaddr, pte, false);
+        vmstat_inc(VMS_EVICT_FILE);
+    } else {
+        pte->index = slot;
+        pte->on_disk = 1;
+    }
+    vmstat_inc(VMS_EVICT);
+    pte->dirty = 0;
+    pte->busy = 0;
+    //the frame is ours now, the disk page belongs to the page table entry
+    set_swap_slot(page_index, -1);
+    set_busy(page_index, false);
+    set_lookup(page_index, NULL, NULL, 0);
+    set_kernel_page(page_index);
+    release_cm_lock();
+
+    bzero((void *)addr, PAGE_SIZE);
+    return addr;
+}
+
+/*
+ * Returns the frame of the page at VADDR of AS if it can join a cluster
+ * being cleaned: resident, dirty, swappable and not in the page cache.
+ * Coremap lock has to be held.
+ */
+static
+bool
+vm_cleanable(struct addrspace *as, vaddr_t vaddr, unsigned int *page_index)
+{
+    struct page_table_entry *pte;
+    unsigned int i;
+
+    pte = pt_lookup(as, vaddr);
+    if(pte == NULL || !pte->valid || pte->on_disk || pte->busy || !pte->dirty) {
+        return false;
+    }
+    i = get_page_index((vaddr_t)pte->index << 12);
+    if(!is_swappable(i) || get_lookup(i) != pte || pc_is_cached(i)) {
+        return false;
+    }
+    *page_index = i;
+    return true;
+}
+
+/*
+ * Clean a cluster of dirty pages, so eviction finds clean frames it can
+ * drop without writing. get_dirty_page picks a page, and its dirty
+ * virtual neighbours join it, up to DM_MAX_CLUSTER_IO pages. They are
+ * pinned and taken out of every TLB like for vm_page_out, then written
+ * to consecutive disk pages in one transfer. They stay resident with the
+ * disk pages as their copies, and a write faults and dirties them again.
+ * Returns the number of pages cleaned, 0 if there was nothing to clean
+ * or the swap had no room for the cluster.
+ */
+static
+unsigned int
+vm_page_clean(void)
+{
+    unsigned int frames[DM_MAX_CLUSTER_IO];
+    vaddr_t addrs[DM_MAX_CLUSTER_IO];
+    struct page_table_entry *pte, *prev;
+    struct addrspace *as;
+    vaddr_t vaddr, first;
+    unsigned int page_index, slot, n, j;
+    int near = -1;
+    int result;
+
+    acquire_cm_lock();
+    if(!get_dirty_page(&page_index)) {
+        release_cm_lock();
+        return 0;
+    }
+    as = get_lookup_as(page_index);
+    vaddr = get_lookup_vaddr(page_index);
+
+    //go back to the first dirty page of the run, then collect it forward
+    first = vaddr;
+    while(vaddr - first < (DM_MAX_CLUSTER_IO - 1) * PAGE_SIZE && first >= PAGE_SIZE &&
+          vm_cleanable(as, first - PAGE_SIZE, &page_index)) {
+        first -= PAGE_SIZE;
+    }
+    for(n = 0; n < DM_MAX_CLUSTER_IO; n++) {
+        if(!vm_cleanable(as, first + n * PAGE_SIZE, &frames[n])) {
+            break;
+        }
+        pte = get_lookup(frames[n]);
+        set_busy(frames[n], true);
+        pte->busy = 1;
+    }
+    KASSERT(n > 0);
+
+    //try to put the run next to its virtual neighbour on disk
+    prev = first >= PAGE_SIZE ? pt_lookup(as, first - PAGE_SIZE) : NULL;
+    if(prev != NULL && prev->valid && prev->on_disk) {
+        near = prev->index + 1;
+    }
+    release_cm_lock();
+
+    //nobody may keep writing through an old translation while we write
+    for(j = 0; j < n; j++) {
+        vm_tlbshootdown_page(as, first + j * PAGE_SIZE);
+        addrs[j] = get_page_vaddr(frames[j]);
+    }
+
+    result = write_pages(addrs, n, near, &slot);
+
+    acquire_cm_lock();
+    for(j = 0; j < n; j++) {
+        pte = get_lookup(frames[j]);
+        if(!result) {
+            //the old copy on disk, if any, is stale
+            release_swap_slot(frames[j]);
+            set_swap_slot(frames[j], slot + j);
+            pte->dirty = 0;
+        }
+        pte->busy = 0;
+        set_busy(frames[j], false);
+    }
+    release_cm_lock();
+
+    if(result) {
+        return 0;
+    }
+    vmstat_add(VMS_CLEAN, n);
+    return n;
+}
+
+/*
+ * The pageout daemon. It sleeps until an allocation takes the number
+ * of free pages below PAGEOUT_LOW. Then it first cleans up to
+ * VM_CLEAN_PAGES dirty pages, in clusters, and pages out a batch of
+ * pages until PAGEOUT_HIGH pages are free again. Faulting threads
+ * usually find a free frame without waiting for the disk, and eviction
+ * mostly finds clean frames it only has to drop.
+ */
+static
+int
+pageout_thread(void *data1, unsigned long data2)
+{
+    vaddr_t addr;
+    unsigned int cleaned, n;
+
+    (void)data1;
+    (void)data2;
+
+    while (true) {
+        pageout_wait();
+
+        cleaned = 0;
+        while (cleaned < VM_CLEAN_PAGES) {
+            n = vm_page_clean();
+            if (n == 0) {
+                break;
+            }
+            cleaned += n;
+        }
+
+        while (get_free_page_count() < PAGEOUT_HIGH) {
+            addr = vm_page_out();
+            if (!addr) {
+                //nothing left we could page out
+                break;
+            }
+            free_kpages(addr);
+        }
+        pageout_done();
+    }
+
+    return 0;
+}
+
+/*
+ * Get a frame for the VM system, paging something out if memory is full.
+ * If there is nothing we can page out ourselves (everything left is
+ * shared, busy or the swap is full), wait for the pageout daemon or for
+ * somebody to give memory back, a few rounds. If that doesn't help, the
+ * OOM killer picks the process with the most pages to die, and we wait
+ * some more rounds for it to go. Returns 0 if there still is no frame,
+ * or if the process we are allocating for is the one being killed.
+ */
+vaddr_t
+vm_alloc_page(void)
+{
+    vaddr_t addr;
+    bool killed = false;
+    int waits = 0;
+
+    while(true) {
+        addr = alloc_kpages(1);
+        if(!addr) {
+            addr = vm_page_out();
+        }
+        if(addr || curproc->p_killed) {
+            return addr;
+        }
+        if(waits == VM_ALLOC_WAITS) {
+            if(killed || proc_oom_kill() < 0) {
+                return 0;
+            }
+            vmstat_inc(VMS_OOM_KILL);
+            killed = true;
+            waits = 0;
+        }
+        waits++;
+        vmstat_inc(VMS_ALLOC_WAIT);
+        pageout_reclaim_wait();
+        if(killed) {
+            //let the victim run to its exit
+            thread_yield();
+        }
+    }
+}
+
+/*
+ * Returns true if PTE maps the zero frame.
+ */
+bool
+vm_is_zero_page(const struct page_table_entry *pte)
+{
+    return pte->valid && !pte->on_disk &&
+           ((vaddr_t)pte->index << 12) == vm_zero_frame;
+}
+
+/*
+ * Break copy-on-write sharing of the page behind PTE before it is
+ * written. If other page tables still map the frame, the faulting
+ * address space gets a private copy and drops its reference to the
+ * shared one. The last one left just takes the frame back. A page of
+ * the zero frame gets a fresh zeroed frame; there is nothing to copy.
+ */
+static
+int
+vm_cow_break(struct addrspace *as, struct page_table_entry *pte, vaddr_t vaddr)
+{
+    unsigned int page_index = get_page_index((vaddr_t)pte->index << 12);
+    bool zero = vm_is_zero_page(pte);
+
+    if(!zero) {
+        acquire_cm_lock();
+        if(get_refcount(page_index) == 1) {
+            //not shared (anymore), make sure the reverse lookup points to us
+            set_lookup(page_index, as, pte, vaddr);
+            release_cm_lock();
+            return 0;
+        }
+        release_cm_lock();
+    }
+
+    //new frames come zeroed, which is all a page of the zero frame needs
+    vaddr_t addr = vm_alloc_page();
+    if(!addr) {
+        return ENOMEM;
+    }
+
+    if(zero) {
+        vmstat_inc(VMS_FAULT_ZEROBREAK);
+    } else {
+        memcpy((void *)addr, (void *)((vaddr_t)pte->index << 12), PAGE_SIZE);
+
+        //drop our reference to the shared frame. if the reverse lookup points
+        //to us, clear it; the other owner sets it again on its next write
+        acquire_cm_lock();
+        if(get_lookup(page_index) == pte) {
+            set_lookup(page_index, NULL, NULL, 0);
+        }
+        release_cm_lock();
+        free_kpages((vaddr_t)pte->index << 12);
+        vmstat_inc(VMS_FAULT_COW);
+    }
+
+    acquire_cm_lock();
+    pte->index = addr >> 12;
+    pte->dirty = 1;
+    set_lookup(get_page_index(addr), as, pte, vaddr);
+    set_user_page(get_page_index(addr));
+    release_cm_lock();
+
+    //other cpus may still have the shared frame in their tlb for us. the
+    //entry on this cpu is replaced when vm_fault loads the new one
+    vm_tlbflush_as_others(as);
+
+    return 0;
+}
+
+/*
+ * Page in the page behind PTE, mapped at VADDR in AS, into the frame ADDR.
+ * Neighbours in [start, end) whose disk pages directly follow or precede
+ * the faulting page's on disk are read in the same transfer, into frames
+ * of their own, and mapped right away: a sequential scan will fault on
+ * them next. This is only done while there are free frames to spare.
+ * The faulting page itself is left for the caller to map.
+ */
+static
+int
+vm_page_in(struct addrspace *as, struct page_table_entry *pte, vaddr_t vaddr,
+           vaddr_t addr, vaddr_t start, vaddr_t end)
+{
+    //the faulting page sits in the middle, neighbours on either side
+    struct page_table_entry *ptes[2 * VM_FAULTAHEAD - 1];
+    struct page_table_entry *npte;
+    vaddr_t frames[2 * VM_FAULTAHEAD - 1];
+    const int mid = VM_FAULTAHEAD - 1;
+    unsigned int slot = pte->index;
+    int before = 0, after = 0;
+    int result, j;
+
+    KASSERT(VM_FAULTAHEAD <= DM_MAX_CLUSTER_IO);
+
+    ptes[mid] = pte;
+    frames[mid] = addr;
+
+    //neighbours have to be in the same segment
+    for(j = 1; 1 + before + after < VM_FAULTAHEAD; j++) {
+        vaddr_t va = vaddr + j * PAGE_SIZE;
+        if(va >= end) {
+            break;
+        }
+        npte = pt_lookup(as, va);
+        if(npte == NULL || !npte->valid || !npte->on_disk || npte->busy ||
+           npte->index != slot + j) {
+            break;
+        }
+        if(get_free_page_count() < PAGEOUT_LOW) {
+            break;
+        }
+        frames[mid + j] = alloc_kpages(1);
+        if(!frames[mid + j]) {
+            break;
+        }
+        ptes[mid + j] = npte;
+        after++;
+    }
+    for(j = 1; 1 + before + after < VM_FAULTAHEAD; j++) {
+        vaddr_t va = vaddr - j * PAGE_SIZE;
+        if(vaddr < start + j * PAGE_SIZE || slot < (unsigned int)j) {
+            break;
+        }
+        npte = pt_lookup(as, va);
+        if(npte == NULL || !npte->valid || !npte->on_disk || npte->busy ||
+           npte->index != slot - j) {
+            break;
+        }
+        if(get_free_page_count() < PAGEOUT_LOW) {
+            break;
+        }
+        frames[mid - j] = alloc_kpages(1);
+        if(!frames[mid - j]) {
+            break;
+        }
+        ptes[mid - j] = npte;
+        before++;
+    }
+
+    result = read_pages(slot - before, &frames[mid - before], 1 + before + after);
+    if(result) {
+        for(j = mid - before; j <= mid + after; j++) {
+            if(j != mid) {
+                free_kpages(frames[j]);
+            }
+        }
+        return result;
+    }
+
+    vmstat_add(VMS_FAULT_AHEAD, before + after);
+
+    //map the neighbours. they are not marked referenced, so the
+    //replacement policy takes them back soon if the bet was wrong
+    acquire_cm_lock();
+    for(j = mid - before; j <= mid + after; j++) {
+        if(j == mid) {
+            continue;
+        }
+        unsigned int page_index = get_page_index(frames[j]);
+        set_swap_slot(page_index, ptes[j]->index);
+        ptes[j]->index = frames[j] >> 12;
+        ptes[j]->on_disk = 0;
+        ptes[j]->dirty = 0;
+        set_lookup(page_index, as, ptes[j], vaddr + (j - mid) * PAGE_SIZE);
+        set_user_page(page_index);
+    }
+    release_cm_lock();
+
+    return 0;
+}
+
+/*
+ * Fill the frame ADDR for the never touched page at VADDR from the
+ * files backing the segments it overlaps. Usually that is one segment,
+ * but the end of one segment and the start of the next may share a
+ * page. Whatever no file covers stays zero, which is how BSS gets
+ * zero-filled. A page of an mmap region is read from the region's file
+ * as a whole; past the end of the file it stays zero as well.
+ */
+static
+int
+vm_page_in_file(struct addrspace *as, vaddr_t vaddr, vaddr_t addr)
+{
+    struct segment_table_entry *region;
+    struct iovec iov;
+    struct uio io;
+    int i, result;
+
+    region = as_find_mmap(as, vaddr);
+    if(region != NULL) {
+        if(region->vnode == NULL) {
+            return 0;
+        }
+        uio_kinit(&iov, &io, (void *)addr, PAGE_SIZE,
+                  region->file_offset + (vaddr - region->start), UIO_READ);
+        return VOP_READ(region->vnode, &io);
+    }
+
+    for(i = 0; i < 4; i++) {
+        struct segment_table_entry *seg = &as->segment_table[i];
+        if(!seg->valid || seg->vnode == NULL) {
+            continue;
+        }
+        //the part of the page the file covers
+        vaddr_t from = seg->start > vaddr ? seg->start : vaddr;
+        vaddr_t to = seg->start + seg->file_size;
+        if(to > vaddr + PAGE_SIZE) {
+            to = vaddr + PAGE_SIZE;
+        }
+        if(from >= to) {
+            continue;
+        }
+
+        uio_kinit(&iov, &io, (void *)(addr + (from - vaddr)), to - from,
+                  seg->file_offset + (from - seg->start), UIO_READ);
+        result = VOP_READ(seg->vnode, &io);
+        if(result) {
+            return result;
+        }
+        if(io.uio_resid != 0) {
+            //the file shrank since we checked it in load_elf
+            return ENOEXEC;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns true if no file supplies any part of the page at VADDR, so a
+ * never touched page there holds nothing but zeros: heap, stack, BSS
+ * past the file's last page and anonymous mappings.
+ */
+static
+bool
+vm_page_anonymous(struct addrspace *as, vaddr_t vaddr)
+{
+    struct segment_table_entry *region;
+    int i;
+
+    region = as_find_mmap(as, vaddr);
+    if(region != NULL) {
+        return region->vnode == NULL;
+    }
+
+    for(i = 0; i < 4; i++) {
+        struct segment_table_entry *seg = &as->segment_table[i];
+        if(!seg->valid || seg->vnode == NULL || seg->file_size == 0) {
+            continue;
+        }
+        if(seg->start < vaddr + PAGE_SIZE && seg->start + seg->file_size > vaddr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Returns true if the never touched page at VADDR holds nothing but the
+ * page of one file at OFFSET: the read-only segments on it all map it
+ * there, and none of it is zero-filled. Every address space running
+ * that file then has the same page there, so it can share one frame
+ * through the page cache. The key is V and the file OFFSET of the page,
+ * the same one mmap uses for the file. The same goes for pages of
+ * shared file mappings, which have to share the frame, and of read-only
+ * private ones.
+ */
+static
+bool
+vm_page_shareable(struct addrspace *as, vaddr_t vaddr, struct vnode **v,
+                  off_t *offset)
+{
+    struct segment_table_entry *region;
+    bool found = false;
+    vaddr_t covered;
+    int i;
+
+    region = as_find_mmap(as, vaddr);
+    if(region != NULL) {
+        if(region->vnode == NULL || (!region->shared && region->write)) {
+            return false;
+        }
+        *v = region->vnode;
+        *offset = region->file_offset + (vaddr - region->start);
+        return true;
+    }
+
+    //every segment on the page has to map it at the same file offset
+    for(i = 0; i < 4; i++) {
+        struct segment_table_entry *seg = &as->segment_table[i];
+        if(!seg->valid || seg->start >= vaddr + PAGE_SIZE || seg->end <= vaddr) {
+            continue;
+        }
+        if(seg->write || seg->vnode == NULL) {
+            return false;
+        }
+        if(!found) {
+            *v = seg->vnode;
+            *offset = seg->file_offset + ((off_t)vaddr - (off_t)seg->start);
+            found = true;
+        } else if(seg->vnode != *v ||
+                  seg->file_offset + ((off_t)vaddr - (off_t)seg->start) != *offset) {
+            return false;
+        }
+    }
+    if(!found) {
+        return false;
+    }
+
+    //and the file has to cover all of it. zero-fill past the file size, or
+    //between segments, is not what the file has at that offset
+    covered = vaddr;
+    while(covered < vaddr + PAGE_SIZE) {
+        for(i = 0; i < 4; i++) {
+            struct segment_table_entry *seg = &as->segment_table[i];
+            if(seg->valid && seg->start <= covered &&
+               seg->start + seg->file_size > covered) {
+                covered = seg->start + seg->file_size;
+                break;
+            }
+        }
+        if(i == 4) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Map the page cache's frame for page OFFSET of V at PTE, if it has one.
+ * Returns ENOENT if there is none. If the frame is being written back to
+ * the file, returns EAGAIN and its index in PAGE_INDEX, for the caller
+ * to wait on.
+ */
+static
+int
+vm_map_cached(struct vnode *v, off_t offset, struct addrspace *as,
+              struct page_table_entry *pte, vaddr_t vaddr,
+              unsigned int *page_index)
+{
+    acquire_cm_lock();
+    if(!pc_lookup(v, offset, page_index)) {
+        release_cm_lock();
+        return ENOENT;
+    }
+    if(get_busy(*page_index)) {
+        release_cm_lock();
+        return EAGAIN;
+    }
+    inc_refcount(*page_index);
+    pte->index = get_page_vaddr(*page_index) >> 12;
+    pte->on_disk = 0;
+    pte->dirty = 0;
+    pt_set_valid(as, vaddr, pte, true);
+    vmstat_inc(VMS_FAULT_CACHED);
+    release_cm_lock();
+    return 0;
+}
+
+/*
+ * Wait until the frame is not being paged out anymore.
+ */
+static
+void
+vm_wait_frame(unsigned int page_index)
+{
+    acquire_cm_lock();
+    while (get_busy(page_index)) {
+        busy_wait();
+    }
+    release_cm_lock();
+}
+
+/*
+ * Write the page at ADDR back to page OFFSET of the file V. Only the part
+ * inside the file is written; a mapping does not make its file grow.
+ */
+int
+vm_page_write_file(struct vnode *v, off_t offset, vaddr_t addr)
+{
+    struct iovec iov;
+    struct uio io;
+    struct stat st;
+    size_t len = PAGE_SIZE;
+    int result;
+
+    result = VOP_STAT(v, &st);
+    if(result) {
+        return result;
+    }
+    if(offset >= st.st_size) {
+        return 0;
+    }
+    if(st.st_size - offset < PAGE_SIZE) {
+        len = st.st_size - offset;
+    }
+    uio_kinit(&iov, &io, (void *)addr, len, offset, UIO_WRITE);
+    return VOP_WRITE(v, &io);
+}
+
+/*
+ * Returns true if VADDR is in a large page: an aligned group of
+ * VM_LPAGE_PAGES pages entirely in the part of a big heap that sbrk
+ * added. MIPS-161 has no TLB entries for more than a page, so a large
+ * page only exists in software. Its pages get frames together on the
+ * first write, and are loaded into the TLB together on a miss, which
+ * saves most faults and TLB misses of a sweep through a big array.
+ * The frames need not be contiguous.
+ */
+static
+bool
+vm_in_lpage(struct addrspace *as, vaddr_t vaddr)
+{
+    vaddr_t group = vaddr & ~(vaddr_t)(VM_LPAGE_SIZE - 1);
+
+    if(!as->heap_base_set || as->heap_top - as->heap_base < VM_LPAGE_MINHEAP) {
+        return false;
+    }
+    return group >= ROUNDUP(as->heap_base, PAGE_SIZE) &&
+           group + VM_LPAGE_SIZE <= ROUNDUP(as->heap_top, PAGE_SIZE);
+}
+
+/*
+ * Give the other never touched pages of the large page VADDR is in a
+ * zeroed frame each, while there are frames to spare. The write fault
+ * on VADDR already took care of that one. They are mapped dirty right
+ * away, so a sweep writing them doesn't fault again. Pages that were
+ * only read so far keep the zero frame until they are written.
+ */
+static
+void
+vm_map_lpage(struct addrspace *as, vaddr_t vaddr)
+{
+    vaddr_t group = vaddr & ~(vaddr_t)(VM_LPAGE_SIZE - 1);
+    struct page_table_entry *pte;
+    vaddr_t va, addr;
+
+    for(va = group; va < group + VM_LPAGE_SIZE; va += PAGE_SIZE) {
+        if(va == (vaddr & PAGE_FRAME)) {
+            continue;
+        }
+        //the group is in the same table as VADDR, so there is an entry
+        pte = pt_lookup(as, va);
+        if(pte == NULL || pte->valid) {
+            continue;
+        }
+        if(get_free_page_count() < PAGEOUT_LOW) {
+            break;
+        }
+        addr = alloc_kpages(1);
+        if(!addr) {
+            break;
+        }
+        acquire_cm_lock();
+        pte->index = addr >> 12;
+        pte->on_disk = 0;
+        pte->dirty = 1;
+        pt_set_valid(as, va, pte, true);
+        set_swap_slot(get_page_index(addr), -1);
+        set_lookup(get_page_index(addr), as, pte, va);
+        set_user_page(get_page_index(addr));
+        release_cm_lock();
+        vmstat_inc(VMS_FAULT_LPAGE);
+    }
+}
+
+/*
+ * Load the other resident pages of the large page VADDR is in into the
+ * TLB, as if the large page had one entry. They get the same entries
+ * the refill fast path would give them. Pages that are busy, on disk,
+ * not there or already in the TLB are left alone. Same locking as the
+ * fast path; runs with interrupts off.
+ */
+static
+void
+vm_tlb_load_lpage(struct addrspace *as, vaddr_t vaddr)
+{
+    vaddr_t group = vaddr & ~(vaddr_t)(VM_LPAGE_SIZE - 1);
+    struct page_table_entry *ptep, pte;
+    uint32_t entryhi, entrylo;
+    unsigned int page_index;
+    vaddr_t va;
+
+    for(va = group; va < group + VM_LPAGE_SIZE; va += PAGE_SIZE) {
+        if(va == (vaddr & PAGE_FRAME)) {
+            continue;
+        }
+        ptep = pt_lookup(as, va);
+        if(ptep == NULL) {
+            continue;
+        }
+        pte = *ptep;
+        if(!pte.valid || pte.on_disk || pte.busy) {
+            continue;
+        }
+        entryhi = vm_tlbhi(va);
+        if(tlb_probe(entryhi, 0) >= 0) {
+            continue;
+        }
+        entrylo = KVADDR_TO_PADDR((vaddr_t)pte.index << 12) | TLBLO_VALID;
+        page_index = get_page_index((vaddr_t)pte.index << 12);
+        if(pte.dirty && get_refcount(page_index) == 1 && get_lookup(page_index) == ptep) {
+            entrylo |= TLBLO_DIRTY;
+        }
+        tlb_random(entryhi, entrylo);
+        vmstat_inc(VMS_TLB_LPAGE);
+    }
+}
+
+/*
+ * TLB refill fast path: the page is valid and resident, and for a
+ * write it is private and was written before. Then all there is to do
+ * is to load the translation. Anything else returns false and takes the
+ * full fault path. Runs with interrupts off.
+ *
+ * The page table entry is not locked. The pageout daemon marks an
+ * entry busy before it sends the shootdown, and the shootdown can't be
+ * taken here before we are done, so it removes anything we load from an
+ * entry that just went busy.
+ */
+static
+bool
+vm_tlb_refill(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+    struct page_table_entry *ptep, pte;
+    uint32_t entryhi, entrylo;
+    unsigned int page_index;
+    int i;
+
+    if (faultaddress >= MIPS_KSEG0 || (faulttype != VM_FAULT_READ &&
+        faulttype != VM_FAULT_WRITE && faulttype != VM_FAULT_READONLY)) {
+        return false;
+    }
+
+    ptep = pt_lookup(as, faultaddress);
+    if (ptep == NULL) {
+        return false;
+    }
+    pte = *ptep;
+    if (!pte.valid || pte.on_disk || pte.busy) {
+        return false;
+    }
+
+    page_index = get_page_index((vaddr_t)pte.index << 12);
+
+    //a dirty page nobody else maps may be written right away. only the
+    //owner adds references to a dirty page (in as_copy), so the count
+    //can't go up under us. a page the reverse lookup doesn't point to
+    //yet was shared copy-on-write; the first write takes the full path,
+    //where vm_cow_break points it back at us
+    entrylo = KVADDR_TO_PADDR((vaddr_t)pte.index << 12) | TLBLO_VALID;
+    if (pte.dirty && get_refcount(page_index) == 1 &&
+        get_lookup(page_index) == ptep) {
+        entrylo |= TLBLO_DIRTY;
+    } else if (faulttype != VM_FAULT_READ) {
+        return false;
+    }
+
+    set_referenced(page_index);
+
+    entryhi = vm_tlbhi(faultaddress);
+    i = tlb_probe(entryhi, 0);
+    if (i >= 0) {
+        tlb_write(entryhi, entrylo, i);
+    } else {
+        tlb_random(entryhi, entrylo);
+    }
+    if (vm_in_lpage(as, faultaddress)) {
+        vm_tlb_load_lpage(as, faultaddress);
+    }
+    return true;
 }
 
 int
@@ -138,6 +1294,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
     int spl = splhigh();
 
+    //the VMS_TLB_ counters are in fault type order
+    if (faulttype >= VM_FAULT_READ && faulttype <= VM_FAULT_READONLY) {
+        vmstat_inc(VMS_TLB_READ + faulttype);
+    }
+
     if (curproc == NULL) {
         /*
          * No process. This is probably a kernel fault early
@@ -157,18 +1318,26 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         splx(spl);
         return EFAULT;
     }
+
+    //the common case: the page is there, just load it into the tlb
+    if (vm_tlb_refill(as, faulttype, faultaddress)) {
+        vmstat_inc(VMS_TLB_REFILL);
+        splx(spl);
+        return 0;
+    }
     
     //loop through all segments and if the fault address is in that segment, check permissions
     //might need segment table lock?
-    int i, found_segment = 0;
+    int i, found_segment = 0, segment = -1;
     for(i=0;i<4;i++) {
         if(faultaddress >= as->segment_table[i].start && faultaddress < as->segment_table[i].end) {
           found_segment = 1;
+          segment = i;
             if(!as->ignore_permissions) {
                 switch (faulttype) {
                     //should probably throw an error somehow instead of kassert
                     case VM_FAULT_READONLY:
-                        KASSERT(as->segment_table[i].write && as->page_table[faultaddress >> 22].valid && ((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].valid);
+                        KASSERT(as->segment_table[i].write && pt_lookup(as, faultaddress) != NULL && pt_lookup(as, faultaddress)->valid);
                         break;
                     case VM_FAULT_READ:
                         KASSERT(as->segment_table[i].read);
@@ -183,12 +1352,28 @@ vm_fault(int faulttype, vaddr_t faultaddress)
             }
         }
     }
+    //then the mmap regions. a bad access there is the process' fault
+    struct segment_table_entry *region = NULL;
+    if(!found_segment) {
+        region = as_find_mmap(as, faultaddress);
+        if(region != NULL) {
+            found_segment = 1;
+            if((faulttype == VM_FAULT_READ && !region->read) ||
+               (faulttype != VM_FAULT_READ && !region->write)) {
+                splx(spl);
+                return EFAULT;
+            }
+        }
+    }
     if(!found_segment) {
         //extend the stack if valid
         if(as->segment_table[SG_STACK].start - faultaddress < 10*PAGE_SIZE) {
             int pages = DIVROUNDUP(as->segment_table[SG_STACK].start - faultaddress, PAGE_SIZE);
-            if(as->segment_table[SG_STACK].start - pages*PAGE_SIZE - as->segment_table[SG_DATA_BSS].end >= 10*PAGE_SIZE) {
+            vaddr_t stack_start = as->segment_table[SG_STACK].start - pages*PAGE_SIZE;
+            if(stack_start - as->segment_table[SG_DATA_BSS].end >= 10*PAGE_SIZE &&
+               !as_range_mapped(as, stack_start - 10*PAGE_SIZE, stack_start)) {
                 as->segment_table[SG_STACK].start -= pages*PAGE_SIZE;
+                segment = SG_STACK;
             } else {
                 splx(spl);
                 return EFAULT;
@@ -196,82 +1381,193 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         }
     }
     
-    //is the first level page table entry aka the second level page table valid?
-    // to access the first level page table entry, you first get the index,
-    // which is the first ten bits of faultaddress, so bitshift down 22.
-    // you then use that to index into as->page-table to get the struct itself.
-    if(!as->page_table[faultaddress >> 22].valid) {
-        vaddr_t addr = alloc_kpages(1);
-        if(!addr) {
-            splx(spl);
-            return EFAULT;
-        }
+    //find the page table entry, making room for it in the table if needed
+    struct page_table_entry *pte = pt_lookup_create(as, faultaddress);
+    if(pte == NULL) {
+        splx(spl);
+        return ENOMEM;
+    }
 
-        as->page_table[faultaddress >> 22].index = addr >> 12;
-        as->page_table[faultaddress >> 22].valid = 1;
+    //the page might be on its way out to disk, wait for it to get there
+    if(pte->busy) {
+        splx(spl);
+        vm_wait_page(pte);
+        spl = splhigh();
     }
-    //is the second level page table entry aka the actual page valid?
-    // to access the second level page table entry, you first access the second
-    // level page table by bitshifting the first level page table entry up 12
-    // to get the vkaddr.  You then cast it as a page_table_entry array, and then
-    // access the index.  The index is the middle 10 bits of faultaddress, so you
-    // bitshift down 12, and then mask out the upper 10 bits.
-    if(!((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].valid ||
-       ((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].on_disk) {
+
+    //read-only pages of an executable another process already has in memory are shared
+    struct vnode *v = NULL;
+    off_t offset = 0;
+    unsigned int cached_index;
+    bool shareable = !pte->valid &&
+        vm_page_shareable(as, faultaddress & PAGE_FRAME, &v, &offset);
+    int cached = shareable ?
+        vm_map_cached(v, offset, as, pte, faultaddress & PAGE_FRAME, &cached_index) : ENOENT;
+
+    if(cached == EAGAIN) {
+        //the page is on its way back to the file, try again once it got there
+        splx(spl);
+        vm_wait_frame(cached_index);
+        return 0;
+    } else if(cached == 0) {
+        //nothing to read, someone else did that already
+    } else if(!pte->valid && faulttype == VM_FAULT_READ &&
+              vm_page_anonymous(as, faultaddress & PAGE_FRAME)) {
+        //a page that was never written reads as zeros. it gets a frame of
+        //its own on the first write, in vm_cow_break
+        acquire_cm_lock();
+        pte->index = vm_zero_frame >> 12;
+        pte->on_disk = 0;
+        pte->dirty = 0;
+        pt_set_valid(as, faultaddress & PAGE_FRAME, pte, true);
+        release_cm_lock();
+        vmstat_inc(VMS_FAULT_ZEROPAGE);
+    } else if(!pte->valid || pte->on_disk) {
         //alloc a kpage
-        vaddr_t addr = alloc_kpages(1);
+        vaddr_t addr = vm_alloc_page();
         if(!addr) {
             splx(spl);
-            return EFAULT;
+            return ENOMEM;
         }
+        int slot = -1;
         // if the page is valid, but not in memory, load it in
-        if(((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].valid  && ((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].on_disk) {
-            if(read_page(((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].index, addr)) {
+        if(pte->valid && pte->on_disk) {
+            slot = pte->index;
+            int result;
+            if(region != NULL) {
+                result = vm_page_in(as, pte, faultaddress & PAGE_FRAME, addr,
+                                    region->start, region->end);
+            } else if(segment >= 0) {
+                result = vm_page_in(as, pte, faultaddress & PAGE_FRAME, addr,
+                                    as->segment_table[segment].start,
+                                    as->segment_table[segment].end);
+            } else {
+                result = read_page(pte->index, addr);
+            }
+            if(result) {
+                free_kpages(addr);
                 splx(spl);
                 return EFAULT;
             }
+            vmstat_inc(VMS_FAULT_SWAPIN);
+        } else if(vm_page_anonymous(as, faultaddress & PAGE_FRAME)) {
+            //first write to a page no file backs, the zeroed frame is all it needs
+            vmstat_inc(VMS_FAULT_ZEROFILL);
+        } else if(vm_page_in_file(as, faultaddress & PAGE_FRAME, addr)) {
+            //first touch, bring in the executable's or mapped file's contents
+            free_kpages(addr);
+            splx(spl);
+            return EFAULT;
+        } else {
+            vmstat_inc(VMS_FAULT_FILE);
+        }
+        acquire_cm_lock();
+        if(shareable && pc_lookup(v, offset, &cached_index) && get_busy(cached_index)) {
+            //theirs is being written back, what we read may be old already
+            release_cm_lock();
+            free_kpages(addr);
+            splx(spl);
+            vm_wait_frame(cached_index);
+            return 0;
+        } else if(shareable && pc_lookup(v, offset, &cached_index)) {
+            //another process read the same page while we did, use theirs
+            inc_refcount(cached_index);
+            pte->index = get_page_vaddr(cached_index) >> 12;
+            pte->on_disk = 0;
+            pt_set_valid(as, faultaddress & PAGE_FRAME, pte, true);
+            pte->dirty = 0;
+            release_cm_lock();
+            free_kpages(addr);
+        } else {
+            // set page table index
+            pte->index = addr >> 12;
+            //set page table on-disk bit to false
+            pte->on_disk = 0;
+            //set page table valid bit
+            pt_set_valid(as, faultaddress & PAGE_FRAME, pte, true);
+            //clean until written; the copy on disk stays with the frame
+            pte->dirty = 0;
+            //set coremap reverse lookup
+            set_swap_slot(get_page_index(addr), slot);
+            set_lookup(get_page_index(addr), as, pte, faultaddress & PAGE_FRAME);
+            //unset coremap kernel bit
+            set_user_page(get_page_index(addr));
+            //let the next process running this file find the page
+            if(shareable) {
+                pc_insert(get_page_index(addr), v, offset);
+            }
+            release_cm_lock();
+            //in a big heap, the rest of the large page comes along. reads
+            //of the heap get the zero frame above, so this is a write
+            if(slot < 0 && vm_in_lpage(as, faultaddress)) {
+                vm_map_lpage(as, faultaddress);
+            }
         }
-        // set page table index
-        ((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].index = addr >> 12;
-        //set page table on-disk bit to false
-        ((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].valid = 0;
-        //set page table valid bit
-        ((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].valid = 1;
-        //set coremap reverse lookup
-        set_lookup(get_page_index(addr),
-                   (struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12));
-        //unset coremap kernel bit
-        set_user_page(get_page_index(addr));
     }
+
+    //a write to a page shared copy-on-write gets its own copy first. pages of
+    //shared mappings are written in place, by whoever maps them
+    if(faulttype != VM_FAULT_READ && region != NULL && region->shared) {
+        acquire_cm_lock();
+        if(pte->valid && !pte->on_disk && !pte->busy &&
+           get_refcount(get_page_index((vaddr_t)pte->index << 12)) == 1) {
+            //the last one left may be paged out through us
+            set_lookup(get_page_index((vaddr_t)pte->index << 12), as, pte, faultaddress & PAGE_FRAME);
+        }
+        release_cm_lock();
+    } else if(faulttype != VM_FAULT_READ) {
+        if(vm_cow_break(as, pte, faultaddress & PAGE_FRAME)) {
+            splx(spl);
+            return ENOMEM;
+        }
+    }
+
+    //if we slept above, the page may have been picked for paging out in the
+    //meantime. let the access fault again instead of mapping a stale frame
+    //the pageout code changes the entry under the coremap lock, so we check
+    //and update it under the lock as well
+    acquire_cm_lock();
+    if(pte->busy || pte->on_disk || !pte->valid) {
+        release_cm_lock();
+        splx(spl);
+        return 0;
+    }
+    //a writable mapping makes the copy on disk (if any) stale
+    if(faulttype != VM_FAULT_READ) {
+        pte->dirty = 1;
+    }
+    release_cm_lock();
+
+    //tell the clock this page is in use
+    set_referenced(get_page_index((vaddr_t)pte->index << 12));
     
     //we are writing the vkaddr of the page itself, so we bitshift up 12 on
     //the second level page table entry's index
-    //int spl = splhigh();
     unsigned int flags = TLBLO_VALID;
     switch (faulttype) {
+        //a write to a page we had mapped readonly (not dirty) and a plain
+        //write both get a dirty entry
         case VM_FAULT_READONLY:
-            //replace the previous not dirty entry in the TLB with a dirtied one.
-            i = tlb_probe(faultaddress & TLBHI_VPAGE, 0);
-            KASSERT(i >= 0);
-            tlb_write(faultaddress & TLBHI_VPAGE, KVADDR_TO_PADDR(((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].index << 12)|TLBLO_DIRTY|TLBLO_VALID, i);
-            break;
-        //read and write are the same except write sets the dirty bit
         case VM_FAULT_WRITE:
             //set the dirty bit
             flags = flags | TLBLO_DIRTY;
         case VM_FAULT_READ:
-            //see if it is already in the tlb
-            i = tlb_probe(faultaddress & TLBHI_VPAGE, 0);
+            //see if it is already in the tlb. paging above may have slept,
+            //so a readonly entry we faulted on might be gone by now
+            i = tlb_probe(vm_tlbhi(faultaddress), 0);
             //if so, replace that entry, else replace a random one
             if(i >= 0)
-                tlb_write(faultaddress & TLBHI_VPAGE, KVADDR_TO_PADDR(((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].index << 12)|flags, i);
+                tlb_write(vm_tlbhi(faultaddress), KVADDR_TO_PADDR((vaddr_t)pte->index << 12)|flags, i);
             else
-                tlb_random(faultaddress & TLBHI_VPAGE, KVADDR_TO_PADDR(((struct page_table_entry *)(as->page_table[faultaddress >> 22].index << 12))[(faultaddress >> 12)&1023].index << 12)|flags);
+                tlb_random(vm_tlbhi(faultaddress), KVADDR_TO_PADDR((vaddr_t)pte->index << 12)|flags);
             break;
         default:
             splx(spl);
             return EINVAL;
     }
+    if(vm_in_lpage(as, faultaddress)) {
+        vm_tlb_load_lpage(as, faultaddress);
+    }
     splx(spl);
     return 0;
 }
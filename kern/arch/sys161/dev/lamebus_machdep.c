@@ -31,6 +31,7 @@
 #include <kern/unistd.h>
 #include <lib.h>
 #include <mips/trapframe.h>
+#include <platform/maxcpus.h>
 #include <cpu.h>
 #include <spl.h>
 #include <clock.h>
@@ -56,24 +57,77 @@
  *
  * The c0_count register increments on every cycle; when the value
  * matches the c0_compare register, the timer interrupt line is
- * asserted. Writing to c0_compare again clears the interrupt.
+ * asserted. Writing to c0_compare again clears the interrupt. The
+ * count is restarted at COUNT along with it, so the interrupt comes
+ * COMPARE - COUNT cycles from now. The count may also restart by
+ * itself when it matches; mainbus_timer_elapsed allows for that.
  */
 static
 void
-mips_timer_set(uint32_t count)
+mips_timer_set(uint32_t count, uint32_t compare)
 {
 	/*
-	 * $11 == c0_compare; we can't use the symbolic name inside
-	 * the asm string.
+	 * $9 == c0_count, $11 == c0_compare; we can't use the symbolic
+	 * names inside the asm string. The count goes second, in case
+	 * writing the compare restarts it.
 	 */
 	__asm volatile(
 		".set push;"		/* save assembler mode */
 		".set mips32;"		/* allow MIPS32 registers */
-		"mtc0 %0, $11;"		/* do it */
+		"mtc0 %1, $11;"		/* do it */
+		"mtc0 %0, $9;"		/* restart the count */
 		".set pop"		/* restore assembler mode */
-		:: "r" (count));
+		:: "r" (count), "r" (compare));
 }
 
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* read c0_count */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+/* Returns true if the timer interrupt is asserted (c0_cause, IP7) */
+static
+bool
+mips_timer_pending(void)
+{
+	uint32_t cause;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $13;"		/* read c0_cause */
+		".set pop"		/* restore assembler mode */
+		: "=r" (cause));
+	return (cause & 0x00008000) != 0;
+}
+
+/* Cycles per hardclock period */
+#define TIMER_PERIOD		(CPU_FREQUENCY / HZ)
+
+/* The longest the timer can be set for without the count wrapping */
+#define TIMER_MAX_HARDCLOCKS	(0xffffffffU / TIMER_PERIOD - 1)
+
+/*
+ * Per-cpu timer state, accessed only by the cpu it belongs to, with
+ * interrupts off. timer_compare is what c0_compare was set to.
+ * timer_base is the count at the last hardclock period boundary
+ * mainbus_timer_elapsed handed out; the cycles past it are written
+ * back into the count when the timer is set again, so partial periods
+ * and the time it took to take the interrupt are not lost.
+ */
+static uint32_t timer_compare[MAXCPUS];
+static uint32_t timer_base[MAXCPUS];
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -112,9 +166,10 @@ mainbus_bootstrap(void)
 	autoconf_lamebus(lamebus, 0);
 
 	/*
-	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
+	 * Configure the MIPS on-chip timer to interrupt after a
+	 * hardclock period. hardclock sets it from then on.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mainbus_timer_set(1);
 }
 
 /*
@@ -258,6 +313,58 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * The on-chip timer, in hardclock periods.
+ */
+
+/*
+ * Cycles since the timer was last set. If it went off and the count
+ * restarted at the match, the cycles up to the match are added back.
+ */
+static
+uint32_t
+timer_count(void)
+{
+	uint32_t count = mips_timer_get();
+	uint32_t compare = timer_compare[curcpu->c_number];
+
+	if (mips_timer_pending() && count < compare) {
+		count += compare;
+	}
+	return count;
+}
+
+void
+mainbus_timer_set(unsigned hardclocks)
+{
+	unsigned n = curcpu->c_number;
+	uint32_t left;
+
+	KASSERT(hardclocks > 0);
+	if (hardclocks > TIMER_MAX_HARDCLOCKS) {
+		hardclocks = TIMER_MAX_HARDCLOCKS;
+	}
+
+	/* Carry the cycles past the last boundary counted into the count */
+	left = timer_count() - timer_base[n];
+	left %= TIMER_PERIOD;
+
+	timer_compare[n] = hardclocks * TIMER_PERIOD;
+	timer_base[n] = 0;
+	mips_timer_set(left, timer_compare[n]);
+}
+
+unsigned
+mainbus_timer_elapsed(void)
+{
+	unsigned n = curcpu->c_number;
+	unsigned periods;
+
+	periods = (timer_count() - timer_base[n]) / TIMER_PERIOD;
+	timer_base[n] += periods * TIMER_PERIOD;
+	return periods;
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -284,9 +391,7 @@ mainbus_interrupt(struct trapframe *tf)
 		lamebus_clear_ipi(lamebus, curcpu);
 	}
 	else if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
+		/* hardclock sets the timer again, which clears the interrupt */
 		hardclock();
 	}
 	else {
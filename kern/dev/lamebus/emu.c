@@ -845,8 +845,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* Files are paged in and out with VOP_READ and VOP_WRITE. */
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
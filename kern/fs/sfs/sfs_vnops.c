@@ -255,14 +255,15 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Files are paged in and out with VOP_READ and
+ * VOP_WRITE, so any of them can be mapped.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
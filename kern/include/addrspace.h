@@ -36,9 +36,13 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
+#include "opt-radixpt.h"
 
 struct vnode;
+struct pt_mid;
+struct pt_leaf;
 
 
 
@@ -60,7 +64,11 @@ struct segment_table_entry {
 	unsigned int write      : 1;
 	unsigned int execute    : 1;
   unsigned int index      : 2;
-	unsigned int :26; // padding to fill 64 bits
+    unsigned int shared     : 1;   // mmap'ed MAP_SHARED: writes go back to the file
+	unsigned int :25; // padding to fill 64 bits
+    struct vnode *vnode;    // file the segment is paged in from, NULL if none
+    off_t file_offset;      // where the segment starts in that file
+    size_t file_size;       // bytes backed by the file, the rest is zero-filled
 };
 
 struct page_table_entry {
@@ -68,9 +76,17 @@ struct page_table_entry {
     unsigned int on_disk    : 1;
     unsigned int valid      : 1;
     unsigned int dirty      : 1;
-    unsigned int            : 5;
+    unsigned int busy       : 1;   // the page is being paged out
+    unsigned int            : 4;
 };
 
+/*
+ * mmap regions are placed top down, starting MMAP_STACK_GAP below the
+ * top of the stack so the stack has room to grow.
+ */
+#define MMAP_MAX 16
+#define MMAP_STACK_GAP (8 * 1024 * 1024)
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -83,11 +99,18 @@ struct addrspace {
 #else
         //stack is last segment, heap is second to last
         struct segment_table_entry segment_table[4];
+#if OPT_RADIXPT
+        struct pt_mid **pt_root;    // radix tree page table, see pagetable.h
+        struct pt_leaf *pt_leaves;  // all its leaves
+#else
         struct page_table_entry* page_table;
+#endif
         unsigned int heap_base_set : 1;
         vaddr_t heap_base; // the heap base. this is set in set_heap_ase
         vaddr_t heap_top; // points to the top of the heap
         unsigned int ignore_permissions : 1;
+        uint32_t as_asid[MAXCPUS]; // per cpu address space ID and its generation, 0 if none
+        struct segment_table_entry mmap_table[MMAP_MAX]; // regions set up by mmap
 
 
 
@@ -133,10 +156,25 @@ struct addrspace {
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_define_backing - make a region defined with as_define_region
+ *                be paged in from a file on demand.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_mmap - set up a region of LEN bytes for mmap, paged in
+ *                from V at OFFSET, or zero-filled if V is NULL. Picks
+ *                the address and hands it back.
+ *
+ *    as_unmap  - remove the part of the mmap regions between VADDR and
+ *                VADDR+LEN and let go of their pages.
+ *
+ *    as_find_mmap - returns the mmap region VADDR is in, NULL if none.
+ *
+ *    as_range_mapped - returns true if any mmap region overlaps the
+ *                range from START up to (but not including) END.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -155,6 +193,16 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesize);
+int               as_define_mmap(struct addrspace *as, size_t len,
+                                 int prot, int flags, struct vnode *v,
+                                 off_t offset, vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+struct segment_table_entry *as_find_mmap(struct addrspace *as, vaddr_t vaddr);
+bool              as_range_mapped(struct addrspace *as, vaddr_t start,
+                                  vaddr_t end);
 
 void              set_heap_base(struct addrspace *as, vaddr_t end_of_segment);
 void *            sbrk__(intptr_t amt, int *err);
@@ -40,8 +40,11 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU when its timer goes off, for
+ * scheduling. The timer is set in hardclock periods, HZ to a second:
+ * for one period while other threads wait for the CPU, for a few when
+ * the current thread is alone (see thread_tick_period), and while the
+ * CPU is idle, not at all until the next timeout is due.
  */
 
 /* hardclocks per second */
@@ -56,11 +59,43 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 
 /*
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * Stop the periodic hardclock of the current CPU before it idles, and
+ * restart it once it has a thread to run. Called by thread_switch with
+ * interrupts off.
+ */
+void clock_idle(void);
+void clock_busy(void);
+
+/*
+ * timerclock() is called on one CPU once a second. It runs the due
+ * timeouts, in case no CPU's timer went off for them.
  */
 void timerclock(void);
 
+/*
+ * Timeouts: call a function at interrupt level, with no locks held,
+ * once some time has gone by. Pending timeouts are kept sorted by
+ * deadline, and every CPU sets its timer to go off by the first one,
+ * so a timeout runs within a hardclock period of its deadline.
+ *
+ * timeout_init sets up TO to call FUNC(DATA). timeout_add arms it to
+ * go off MSECS milliseconds from now, rearming it if it is already
+ * pending. timeout_del disarms it and returns true if it was pending;
+ * if it returns false, the function may be running on another CPU.
+ * The structure belongs to the timeout code while it is pending.
+ */
+struct timeout {
+	struct timespec to_when;	/* deadline */
+	void (*to_func)(void *);	/* function to call */
+	void *to_data;			/* its argument */
+	struct timeout *to_next;	/* next on the pending list */
+	bool to_pending;		/* on the pending list */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *data);
+void timeout_add(struct timeout *to, unsigned msecs);
+bool timeout_del(struct timeout *to);
+
 /*
  * gettime() may be used to fetch the current time of day.
  */
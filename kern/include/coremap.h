@@ -3,9 +3,14 @@
 
 #define BOOKKEEPING
 
+// uncomment to fill freed pages with 0xDEADBEEF (debugging only, costs a page write per free)
+//#define DEADBEEF_FREED_PAGES
+
 #include <types.h>
 #include <addrspace.h>
 
+struct vnode;
+
 struct dummy_table_entry{
 	int test;
 };
@@ -14,13 +19,35 @@ struct cm_entry{
 
     int free               				;  // indicates if the page is free
     int kernel             				;  // indicates if the page is a kernel page
+    struct addrspace *as;           	 // address space the page table entry belongs to
     struct page_table_entry *pte;   	 // pointer to the page table entry
+    vaddr_t vaddr;                  	 // user virtual address the page is mapped at
+    unsigned int refcount       		;  // number of page table entries mapping the page (copy-on-write)
+    unsigned int npages         		;  // length of the allocation starting at this page
+    int order                  			;  // buddy order if this is the head of a free block, -1 otherwise
+    int next                   			;  // next free block of the same order, -1 terminates
+    int prev                   			;  // previous free block of the same order, -1 if list head
+    int zeroed                 			;  // indicates if the page was zeroed by the pagezero thread
+    int referenced             			;  // set on every tlb fault, cleared by the clock hand
+    int busy                   			;  // the page is being paged out and must not be touched
+    unsigned int age            		;  // reference history for the aging policy, msb = latest sweep
+    int swap_slot              			;  // disk page holding a copy of the page, -1 if none
+    struct vnode *pc_vnode;         	 // file the page caches a page of, NULL if not in the page cache
+    off_t pc_offset;                	 // offset of that page in the file
+    int pc_next                			;  // next page in the same page cache bucket, -1 terminates
     //unsigned int                    : 30; // this is a huge waste of space. refactor at some point
 
 };
 
 struct empty_struct{};
 
+// free pages are kept in buddy free lists of blocks of 2^order pages
+#define CM_MAX_ORDER 10
+
+// the pageout daemon wakes up below PAGEOUT_LOW free pages and reclaims up to PAGEOUT_HIGH
+#define PAGEOUT_LOW  16
+#define PAGEOUT_HIGH 48
+
 // acquires / releases the coremap lock
 void acquire_cm_lock(void);
 void release_cm_lock(void);
@@ -43,9 +70,15 @@ bool is_free(unsigned int page_index);
 // sets the specified page to occupied
 void set_occupied(unsigned int page_index);
 
-// sets the specified page to free and writes deadbeef
+// sets the specified page to free (and writes deadbeef if DEADBEEF_FREED_PAGES)
 void set_free(unsigned int page_index);
 
+// clears the zeroed flag of the page. returns true if the page was pre-zeroed
+bool clear_zeroed(unsigned int page_index);
+
+// starts the pagezero thread which keeps a pool of pre-zeroed pages
+void pagezero_bootstrap(void);
+
 // checks if the speciefied page is a kernel page
 bool is_kernel_page(unsigned int page_index);
 
@@ -55,18 +88,122 @@ void set_kernel_page(unsigned int page_index);
 // sets the specified page as a user page
 void set_user_page(unsigned int page_index);
 
-// get the index of a free page. returns false if RAM full
+// get the index of a free page, pre-zeroed ones first. the page is taken off the
+// free lists but still has to be set occupied. returns false if RAM full
 bool get_free_page(unsigned int* page_index);
 
-// set the reverse lookup entry of the page
-void set_lookup(unsigned int page_index, struct page_table_entry * pte);
+// get the index of the first page of NPAGES contiguous free pages. same rules
+// as get_free_page. returns false if there is no big enough run
+bool get_free_pages(unsigned int npages, unsigned int* page_index);
+
+// sets / gets the number of pages of the allocation starting at the page
+void set_run_length(unsigned int page_index, unsigned int npages);
+unsigned int get_run_length(unsigned int page_index);
+
+// set the reverse lookup entry of the page, the address space it belongs to and the user
+// address it is mapped at
+void set_lookup(unsigned int page_index, struct addrspace * as, struct page_table_entry * pte, vaddr_t vaddr);
+
+// returns the reverse lookup entry / its address space / the user address of the page
+struct page_table_entry* get_lookup(unsigned int page_index);
+struct addrspace* get_lookup_as(unsigned int page_index);
+vaddr_t get_lookup_vaddr(unsigned int page_index);
+
+// marks the page as recently used. called from vm_fault
+void set_referenced(unsigned int page_index);
+
+// clears the referenced bit of the page. returns its old value
+bool clear_referenced(unsigned int page_index);
+
+// returns / sets the age of the page for the aging policy
+unsigned int get_age(unsigned int page_index);
+void set_age(unsigned int page_index, unsigned int age);
+
+// pins / unpins the page while it is being paged out. unpinning wakes the threads
+// in busy_wait. coremap lock has to be held
+void set_busy(unsigned int page_index, bool busy);
+
+// sleeps until some busy page is unpinned. coremap lock has to be held
+void busy_wait(void);
+
+// returns true if the page is being paged out
+bool get_busy(unsigned int page_index);
+
+// returns / sets the disk page holding a copy of the page, -1 if none
+int get_swap_slot(unsigned int page_index);
+void set_swap_slot(unsigned int page_index, int slot);
+
+// gives the disk page holding a copy of the page back to the diskmap
+void release_swap_slot(unsigned int page_index);
+
+// returns the number of free pages
+unsigned int get_free_page_count(void);
+
+// returns the fewest free pages there have been since boot
+unsigned int get_free_page_low(void);
+
+// creates the wait channels of the pageout code. called before the daemon starts
+void pageout_bootstrap(void);
+
+// sleeps until the number of free pages drops below PAGEOUT_LOW. used by the pageout daemon
+void pageout_wait(void);
+
+// wakes the pageout daemon and sleeps until a page is freed or the daemon is done with
+// its pass. used by allocations that found no free page
+void pageout_reclaim_wait(void);
+
+// wakes the threads in pageout_reclaim_wait. called by the pageout daemon after a pass
+void pageout_done(void);
+
+// returns the number of user pages whose reverse lookup points into the address space
+unsigned int get_resident_count(struct addrspace* as);
+
+// returns the number of references held on the page
+unsigned int get_refcount(unsigned int page_index);
+
+// adds a reference to the page. used to share a page copy-on-write
+void inc_refcount(unsigned int page_index);
+
+// drops a reference to the page. returns true if it was the last one
+bool dec_refcount(unsigned int page_index);
 
 // returns the number of pages available
 unsigned int get_coremap_size(void);
 
-// returns a swappable page. a swapable page is every page which is not a kernel page and occupied
+// page cache: pages of read-only file segments and of shared file mappings, keyed by
+// (vnode, file offset), that address spaces using the same file share. a page stays in
+// the cache while anyone maps it and leaves it when it is freed or paged out. a page
+// written through a shared mapping stays in it until it is back in the file. coremap
+// lock has to be held
+
+// looks up the page caching the page at offset of v. returns false if there is none
+bool pc_lookup(struct vnode* v, off_t offset, unsigned int* page_index);
+
+// enters the page into the page cache as the page at offset of v
+void pc_insert(unsigned int page_index, struct vnode* v, off_t offset);
+
+// takes the page out of the page cache, if it is in it
+void pc_remove(unsigned int page_index);
+
+// returns true if the page is in the page cache
+bool pc_is_cached(unsigned int page_index);
+
+// returns the file and the offset in it the page caches. the page has to be cached
+void pc_get_key(unsigned int page_index, struct vnode** v, off_t* offset);
+
+// returns a swappable page picked by the configured replacement policy (see pagepolicy.h).
+// coremap lock has to be held
 bool get_swappable_page(unsigned int* page_index);
 
+// returns true if the page may be paged out: it is occupied, not a kernel page, not busy,
+// not shared copy-on-write and has a reverse lookup
+bool is_swappable(unsigned int page_index);
+
+// returns a swappable page whose page table entry is dirty, for the pageout daemon to write
+// out ahead of eviction. pages in the page cache and pages used lately are left alone.
+// coremap lock has to be held. returns false if there is none
+bool get_dirty_page(unsigned int* page_index);
+
 
 
 // book keeping (cbk - coremap book keeping)
@@ -74,7 +211,6 @@ unsigned int cbk_pages_allocated;
 unsigned int cbk_pages_freed;
 unsigned int cbk_pages_in_use;
 unsigned int cbk_pages_free;
-struct vnode* swap_disk;
 
 
 
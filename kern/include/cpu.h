@@ -35,6 +35,7 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 #include <synch.h>
+#include <kern/vmstat.h> /* for VMS_NCOUNTERS */
 
 /*
  * Per-cpu structure
@@ -46,6 +47,9 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/* Number of free frames a cpu can cache for alloc_kpages/free_kpages */
+#define CPU_FRAME_MAGAZINE 32
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -59,9 +63,50 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	
-	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_hardclocks;		/* Hardclock periods gone by */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * The timer is set for a variable number of hardclock periods;
+	 * c_tickless is set while it is stopped for idling (see clock.c).
+	 */
+	bool c_tickless;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Magazine of free frames (coremap indexes), refilled from
+	 * and drained to the coremap in batches.
+	 */
+	unsigned c_frames[CPU_FRAME_MAGAZINE];
+	unsigned c_numframes;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Address space IDs are handed out per cpu. c_asid_last is the
+	 * last one handed out, with a generation count in the bits above
+	 * the ID; c_tlbpid is the TLB PID of the running address space.
+	 */
+	uint32_t c_asid_last;
+	uint32_t c_tlbpid;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * The idle thread is parked on no list. It is switched to when
+	 * the current thread has to leave this cpu for one it may run
+	 * on (c_outbound) and there is nothing else to run, so the cpu
+	 * doesn't idle on the stack of a thread running elsewhere. See
+	 * thread_switch.
+	 */
+	struct thread *c_idlethread;
+	struct thread *c_outbound;
+
+	/*
+	 * Written only by this cpu, with interrupts off; read by anyone.
+	 * VM event counters, see vmstat.h.
+	 */
+	uint32_t c_vmstat[VMS_NCOUNTERS];
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -72,6 +117,10 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	struct threadlist c_stridequeue; /* Stride class threads, by pass */
+	unsigned c_tickets;		/* Tickets of c_stridequeue */
+	uint32_t c_pass;		/* Virtual time of the stride class */
+	uint32_t c_defpass;		/* Pass of the default class */
 
 	/*
 	 * Accessed only by this cpu.
@@ -96,6 +145,14 @@ struct cpu {
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Also protected by the IPI lock.
+	 * Shootdowns queued on this cpu so far, and how many of them
+	 * it has carried out. ipi_tlbshootdown_sync waits on these.
+	 */
+	uint32_t c_shootdown_queued;
+	uint32_t c_shootdown_done;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -114,6 +171,8 @@ struct cpu {
  * for the cpu.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
@@ -161,6 +220,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_sync sends TLB shootdown data to all other CPUs that
+ * may have the mapping (see vm_tlbshootdown_needed) and waits until
+ * they have invalidated it.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -175,6 +237,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_sync(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
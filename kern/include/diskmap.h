@@ -20,18 +20,56 @@ void dm_set_occupied(unsigned int page_index);
 // get the index of a free page. page will be marked as occupied. returns false if disk full
 bool dm_get_free_page(unsigned int* page_index);
 
-// sets up the space in virtual memory to hold the diskmap 
-// !!! We call alloc_kpages several times to get contiguous memory.
-// !!! Since bootstrap is called directly after the coremap bootstrap we assume we get contiguous memory
+// get npages contiguous free pages. they will be marked as occupied. returns false if there is no such run
+bool dm_get_free_pages(unsigned int npages, unsigned int* first);
+
+// get npages contiguous free pages, preferably starting at page near (-1 for none). they will be
+// marked as occupied. returns false if there is no such run
+bool dm_get_free_pages_near(int near, unsigned int npages, unsigned int* first);
+
+// get a free page, preferably page near (-1 for none). page will be marked as occupied. returns false if disk full
+bool dm_get_free_page_near(int near, unsigned int* page_index);
+
+// disk pages are numbered across all swap devices. most devices in use at once,
+// longest device name
+#define SWAP_MAX_DEVS 4
+#define SWAP_NAME_LEN 16
+
+// sets up the diskmap
 void diskmap_bootstrap(void);
 
+// adds lhd0raw: as swap. called once the devices are probed
 int swap_bootstrap(void);
 
-//read a page out from disk onto physical memory
+// adds the device (e.g. lhd1raw:) as swap, sized from the device. devices of higher
+// priority fill up first, pages go round the devices of the same priority
+int swap_on(const char* name, int prio);
+
+// takes the device out of use. returns EBUSY while pages are swapped out to it
+int swap_off(const char* name);
+
+// prints the swap devices in use
+void swap_print(void);
+
+//read a page out from disk onto physical memory. the disk page stays occupied
 int read_page(unsigned int page_index, vaddr_t kpage_addr);
 
-//write a page from physical memory out to disk and returns the disk page index
-int write_page(vaddr_t kpage_addr, unsigned int * ret);
+//most pages read_pages / write_pages will transfer at once
+#define DM_MAX_CLUSTER_IO 16
+
+//read npages consecutive disk pages in one transfer, each into its own physical page
+int read_pages(unsigned int page_index, const vaddr_t * kpage_addrs, unsigned int npages);
+
+//write a page from physical memory out to disk and returns the disk page index.
+//near is the disk page it should preferably go to, or -1
+int write_page(vaddr_t kpage_addr, int near, unsigned int * ret);
+
+//write npages physical pages out to npages consecutive disk pages in one transfer and returns
+//the first disk page index. near is the disk page the run should preferably start at, or -1
+int write_pages(const vaddr_t * kpage_addrs, unsigned int npages, int near, unsigned int * ret);
+
+//write a page from physical memory out to the given, already occupied disk page
+int write_page_at(unsigned int page_index, vaddr_t kpage_addr);
 
 
 // performs a selftest on the diskmap
@@ -0,0 +1,24 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap() and munmap().
+ */
+
+/* Protection of a mapping: PROT_NONE or any of the others. */
+#define PROT_NONE     0      /* Not accessible */
+#define PROT_READ     1      /* Readable */
+#define PROT_WRITE    2      /* Writeable */
+#define PROT_EXEC     4      /* Executable */
+
+/* Flags for mmap: choose one of these: */
+#define MAP_SHARED    1      /* Writes go to the file, other mappings see them */
+#define MAP_PRIVATE   2      /* Writes stay in this process */
+/* then or in: */
+#define MAP_ANON      0x1000 /* Zero-filled memory, no file (private only) */
+#define MAP_ANONYMOUS MAP_ANON
+
+/* mmap's error return */
+#define MAP_FAILED    ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -196,6 +196,11 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS___vmstat     121
+#define SYS_sched_setaffinity 122
+#define SYS_sched_getaffinity 123
+#define SYS_sched_settickets 124
+#define SYS_sched_gettickets 125
 
 /*CALLEND*/
 
@@ -0,0 +1,54 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Virtual memory statistics, as returned by __vmstat().
+ *
+ * The event counters count since boot and wrap around. The TLB fault
+ * counters are in the order of the fault types the trap code passes
+ * to vm_fault.
+ */
+
+/* TLB faults, by type */
+#define VMS_TLB_READ         0   /* TLB misses on loads */
+#define VMS_TLB_WRITE        1   /* TLB misses on stores */
+#define VMS_TLB_READONLY     2   /* stores through read-only entries */
+#define VMS_TLB_REFILL       3   /* of them, handled by the refill fast path */
+#define VMS_TLB_LPAGE        4   /* entries loaded along with their large page */
+
+/* Page faults, by how the page was found */
+#define VMS_FAULT_ZEROFILL   5   /* got a fresh zeroed frame */
+#define VMS_FAULT_ZEROPAGE   6   /* read, mapped to the zero frame */
+#define VMS_FAULT_FILE       7   /* read in from the executable or a mapped file */
+#define VMS_FAULT_CACHED     8   /* found in the page cache */
+#define VMS_FAULT_SWAPIN     9   /* read in from swap */
+#define VMS_FAULT_AHEAD      10  /* neighbours read in from swap with a fault */
+#define VMS_FAULT_LPAGE      11  /* mapped along with their large page */
+#define VMS_FAULT_COW        12  /* writes that copied a shared frame */
+#define VMS_FAULT_ZEROBREAK  13  /* first writes to a page of the zero frame */
+
+/* Paging */
+#define VMS_EVICT            14  /* pages taken away by the pageout code */
+#define VMS_EVICT_FILE       15  /* of them, dropped or written back to their file */
+#define VMS_CLEAN            16  /* dirty pages written to swap ahead of eviction */
+#define VMS_SWAP_READ        17  /* pages read from swap */
+#define VMS_SWAP_WRITE       18  /* pages written to swap */
+
+/* Coremap lock */
+#define VMS_CMLOCK           19  /* acquisitions */
+#define VMS_CMLOCK_CONTENDED 20  /* of them, found it held by another cpu */
+
+/* Memory pressure */
+#define VMS_ALLOC_WAIT       21  /* times a fault waited for memory to be reclaimed */
+#define VMS_OOM_KILL         22  /* processes killed for memory */
+
+#define VMS_NCOUNTERS        23
+
+struct vmstat {
+	__u32 vs_counters[VMS_NCOUNTERS];
+	__u32 vs_pages;		/* pages of RAM the coremap manages */
+	__u32 vs_free;		/* free pages now */
+	__u32 vs_free_low;	/* fewest free pages there have been */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
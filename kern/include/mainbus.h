@@ -55,6 +55,16 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Set the current cpu's timer to interrupt once, HARDCLOCKS hardclock
+ * periods (1/HZ s) after the last period mainbus_timer_elapsed counted,
+ * and clear its pending interrupt. mainbus_timer_elapsed returns the
+ * whole periods that went by since it last did; the part of a period
+ * left over is counted the next time.
+ */
+void mainbus_timer_set(unsigned hardclocks);
+unsigned mainbus_timer_elapsed(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -0,0 +1,31 @@
+#ifndef _H_PAGEPOLICY_
+#define _H_PAGEPOLICY_
+
+#include <types.h>
+
+/*
+ * Page replacement policy.
+ *
+ * get_swappable_page asks the policy for a victim, with the coremap
+ * lock held. A policy only looks at the coremap through its accessors
+ * (is_swappable, clear_referenced, get_age/set_age) and must return a
+ * page for which is_swappable is true, or false if there is none.
+ *
+ * The policy is chosen in the kernel config:
+ *    options pagerandom     random victim (the original policy)
+ *    options pageaging      WSClock style aging
+ *    (neither)              clock / second chance
+ */
+struct page_policy {
+	const char *pp_name;
+	bool (*pp_select)(unsigned int *page_index);
+};
+
+extern const struct page_policy random_policy;
+extern const struct page_policy clock_policy;
+extern const struct page_policy aging_policy;
+
+// returns the policy picked by the kernel config
+const struct page_policy* page_policy_get(void);
+
+#endif // _H_PAGEPOLICY_
@@ -0,0 +1,65 @@
+#ifndef _H_PAGETABLE_
+#define _H_PAGETABLE_
+
+#include <types.h>
+#include "opt-radixpt.h"
+
+/*
+ * Per address space page table.
+ *
+ * Two implementations, picked in the kernel config:
+ *    (default)          two-level table: a 4K first level page whose
+ *                       entries point to 4K second level pages of 1024
+ *                       page table entries, each covering 4MB
+ *    options radixpt    radix tree of small nodes. Every leaf holds
+ *                       PT_LEAF_PTES entries and counts how many of them
+ *                       are valid; the leaves of an address space are
+ *                       kept on a list. Walking the table (as_copy,
+ *                       as_destroy) costs in proportion to the parts of
+ *                       the address space that were touched, not to its
+ *                       span.
+ *
+ * Page table entries never move once they exist, so the coremap may
+ * keep pointers to them. They go away in pt_destroy only.
+ *
+ * A page table entry is made valid or invalid with pt_set_valid, so the
+ * occupancy counts stay right. That happens under the coremap lock, or
+ * on an address space nobody else can see yet.
+ */
+
+struct addrspace;
+struct page_table_entry;
+struct pt_leaf;
+
+// iterator over the valid page table entries of an address space
+struct pt_iter {
+	struct addrspace *pi_as;
+#if OPT_RADIXPT
+	struct pt_leaf *pi_leaf;
+#else
+	unsigned pi_l1;
+#endif
+	unsigned pi_index;
+};
+
+// sets up / tears down the page table of the address space. pt_destroy
+// only frees the table itself, not the pages it maps
+int pt_create(struct addrspace *as);
+void pt_destroy(struct addrspace *as);
+
+// returns the page table entry for vaddr, NULL if there is no table space for it yet
+struct page_table_entry *pt_lookup(struct addrspace *as, vaddr_t vaddr);
+
+// returns the page table entry for vaddr, making table space for it if needed.
+// returns NULL if out of memory
+struct page_table_entry *pt_lookup_create(struct addrspace *as, vaddr_t vaddr);
+
+// sets the valid bit of pte, the entry for vaddr
+void pt_set_valid(struct addrspace *as, vaddr_t vaddr, struct page_table_entry *pte, bool valid);
+
+// walks the valid page table entries of the address space in no particular order.
+// pt_iter_next returns NULL at the end
+void pt_iter_init(struct pt_iter *it, struct addrspace *as);
+struct page_table_entry *pt_iter_next(struct pt_iter *it, vaddr_t *vaddr);
+
+#endif // _H_PAGETABLE_
@@ -78,6 +78,13 @@ struct proc {
 
 	struct semaphore *p_exit_sem_child;
 	struct semaphore *p_exit_sem_parent;
+
+	/* Scheduling */
+	unsigned p_tickets;		/* stride class tickets of new threads, 0 for none */
+
+	/* OOM killer */
+	volatile bool p_killed;		/* exit on the way back to user mode */
+	struct proc *p_allnext;		/* next on the list of all processes */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -104,5 +111,18 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Set / get the cpu affinity of the threads of process PID, 0 for the current one. */
+int proc_setaffinity(pid_t pid, uint32_t mask);
+int proc_getaffinity(pid_t pid, uint32_t *mask);
+
+/* Set / get the stride class tickets of process PID, 0 for the current one.
+ * Zero tickets put it back in the default class. */
+int proc_settickets(pid_t pid, unsigned tickets);
+int proc_gettickets(pid_t pid, unsigned *tickets);
+
+/* Out of memory: mark the process with the most resident pages to be
+ * killed. Returns its PID, or -1 if there is nobody left to kill. */
+int proc_oom_kill(void);
+
 
 #endif /* _PROC_H_ */
@@ -73,4 +73,17 @@ int sys_read(struct trapframe *tf, int32_t *ret);
 int sys_write(struct trapframe *tf, int32_t *ret);
 int sys_close(struct trapframe *tf, int32_t *ret);
 
+// memory mapping
+int sys_mmap(struct trapframe *tf, int32_t *ret);
+int sys_munmap(struct trapframe *tf, int32_t *ret);
+
+// vm statistics
+int sys___vmstat(userptr_t user_vs);
+
+// scheduling
+int sys_sched_setaffinity(pid_t pid, uint32_t mask);
+int sys_sched_getaffinity(pid_t pid, userptr_t user_mask);
+int sys_sched_settickets(pid_t pid, unsigned tickets);
+int sys_sched_gettickets(pid_t pid, userptr_t user_tickets);
+
 #endif /* _SYSCALL_H_ */
@@ -46,6 +46,13 @@ struct cpu;
 #include <machine/thread.h>
 
 
+/* Affinity mask allowing every cpu */
+#define THREAD_AFFINITY_ALL 0xffffffff
+
+/* Stride class: tickets of the default class as a whole, and the most a thread may have */
+#define THREAD_TICKETS_DEFAULT	100
+#define THREAD_TICKETS_MAX	10000
+
 /* Size of kernel stacks; must be power of 2 */
 #define STACK_SIZE 4096
 
@@ -101,6 +108,41 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields.
+	 *
+	 * The scheduler is a multi-level feedback queue; t_level is
+	 * the thread's level in it, 0 being the highest. While the
+	 * thread is on a run queue these are protected by that run
+	 * queue's lock, otherwise only the thread itself uses them.
+	 */
+	unsigned t_level;		/* Priority level, 0 is the highest */
+	unsigned t_ticks;		/* Hardclocks used of the slice */
+	unsigned t_waited;		/* schedule() calls spent waiting */
+	bool t_background;		/* Stays on the lowest level */
+
+	/*
+	 * Affinity. t_cpu is also the cpu the thread last ran on;
+	 * t_lastran is when, in that cpu's hardclocks, so its cache
+	 * may still be warm. t_affinity is written by anyone and
+	 * taken into account the next time the thread is queued.
+	 */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when it left */
+	uint32_t t_affinity;		/* Cpus it may run on, bit per c_number */
+
+	/*
+	 * Proportional share. A thread with tickets is in the stride
+	 * class rather than the feedback queue. t_tickets is written by
+	 * anyone and takes effect the next time the thread is queued,
+	 * when it is copied to t_share; t_share and t_pass belong to the
+	 * scheduler like the fields above. t_pass is the thread's
+	 * virtual time on t_cpu (see runqueue_insert); while it sleeps
+	 * it is kept relative to that cpu's c_pass.
+	 */
+	unsigned t_tickets;		/* Tickets wanted, 0 for the default class */
+	unsigned t_share;		/* Tickets in effect, 0 if not in the class */
+	uint32_t t_pass;		/* Stride pass */
+
 	/*
 	 * Public fields
 	 */
@@ -176,6 +218,46 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge TICKS hardclock periods to the current thread and yield if
+ * its time slice is used up or a thread of a higher priority is
+ * waiting. Called from the timer interrupt.
+ */
+void thread_tick(unsigned ticks);
+
+/*
+ * Number of hardclock periods until the current cpu's next tick is
+ * due: 1 if other threads are waiting for it, more if the current
+ * thread is alone. Called from the timer interrupt.
+ */
+unsigned thread_tick_period(void);
+
+/*
+ * Make the current thread a background thread, which only gets the
+ * cpu when nothing else wants it.
+ */
+void thread_set_background(void);
+
+/*
+ * Restrict thread T to the cpus in MASK, a bit per cpu number. New
+ * threads inherit the mask of the thread that forked them. Returns
+ * EINVAL if MASK leaves no cpu. If T is the current thread it moves
+ * right away, so no spinlocks may be held then; other threads move
+ * the next time they are queued, or from the run queue within a few
+ * hardclocks.
+ */
+int thread_setaffinity(struct thread *t, uint32_t mask);
+
+/*
+ * Put thread T in the stride class with TICKETS tickets, or back in
+ * the default class if TICKETS is 0. Among the threads queued on a
+ * cpu, a stride thread gets the cpu in proportion to its tickets; the
+ * default class competes as a whole with THREAD_TICKETS_DEFAULT.
+ * Returns EINVAL if TICKETS is above THREAD_TICKETS_MAX. Takes effect
+ * the next time T is queued.
+ */
+int thread_settickets(struct thread *t, unsigned tickets);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -39,6 +39,8 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -59,5 +61,34 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Whether the given cpu may have the mapping in its TLB at all */
+bool vm_tlbshootdown_needed(const struct tlbshootdown *, unsigned cpunum);
+
+/* Invalidate a user page everywhere it may be in a TLB, and wait for it */
+void vm_tlbshootdown_page(struct addrspace *as, vaddr_t vaddr);
+
+/* Address space IDs: switch the TLB to an address space, and make the
+ * TLB forget an address space's mappings on all cpus or on the others */
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlbflush_as(struct addrspace *as);
+void vm_tlbflush_as_others(struct addrspace *as);
+
+/* Page out a user page and return its frame, 0 if there is none */
+vaddr_t vm_page_out(void);
+
+/* Get a frame, paging something out if there is no free one, 0 if none */
+vaddr_t vm_alloc_page(void);
+
+/* Write a page back to the part of page OFFSET of V that is inside the file */
+struct vnode;
+int vm_page_write_file(struct vnode *v, off_t offset, vaddr_t addr);
+
+/* Wait until a page that is being paged out has settled */
+struct page_table_entry;
+void vm_wait_page(struct page_table_entry *pte);
+
+/* Whether PTE maps the zero frame, which is shared and never freed */
+bool vm_is_zero_page(const struct page_table_entry *pte);
+
 
 #endif /* _VM_H_ */
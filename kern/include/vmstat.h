@@ -0,0 +1,20 @@
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+/*
+ * VM statistics. Every cpu counts its own events in c_vmstat, with
+ * interrupts off, so counting takes no lock. The counts are added up
+ * when somebody asks for them; events before the first cpu exists go
+ * to a separate set of counters.
+ */
+
+#include <kern/vmstat.h>
+
+/* Count N / one events of kind COUNTER (VMS_*) */
+void vmstat_add(unsigned counter, uint32_t n);
+void vmstat_inc(unsigned counter);
+
+/* Add up the counters of all cpus and fill in the rest of VS */
+void vmstat_get(struct vmstat *vs);
+
+#endif /* _VMSTAT_H_ */
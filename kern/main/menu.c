@@ -41,6 +41,10 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <coremap.h>
+#include <pagepolicy.h>
+#include <vmstat.h>
+#include <diskmap.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include <current.h>
@@ -388,6 +392,72 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Commands for configuring swap. Devices of the same priority are
+ * striped, higher priorities fill up first.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	char device[SWAP_NAME_LEN];
+	int prio = 0;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: swapon device: [priority]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		prio = atoi(args[2]);
+	}
+
+	/* Allow (but do not require) colon after device name */
+	if (strlen(args[1]) + 2 > sizeof(device)) {
+		return ENAMETOOLONG;
+	}
+	strcpy(device, args[1]);
+	if (device[strlen(device)-1] != ':') {
+		strcat(device, ":");
+	}
+
+	return swap_on(device, prio);
+}
+
+static
+int
+cmd_swapoff(int nargs, char **args)
+{
+	char device[SWAP_NAME_LEN];
+
+	if (nargs != 2) {
+		kprintf("Usage: swapoff device:\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device name */
+	if (strlen(args[1]) + 2 > sizeof(device)) {
+		return ENAMETOOLONG;
+	}
+	strcpy(device, args[1]);
+	if (device[strlen(device)-1] != ':') {
+		strcat(device, ":");
+	}
+
+	return swap_off(device);
+}
+
+static
+int
+cmd_swapinfo(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	swap_print();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -400,6 +470,48 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for printing the VM statistics, so page replacement
+ * policies and vm workloads can be compared.
+ */
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	struct vmstat vs;
+	uint32_t *n = vs.vs_counters;
+
+	(void)nargs;
+	(void)args;
+
+	vmstat_get(&vs);
+
+	kprintf("policy %s\n", page_policy_get()->pp_name);
+	kprintf("tlb faults: %u read, %u write, %u readonly; "
+		"%u refilled fast, %u loaded with their large page\n",
+		n[VMS_TLB_READ], n[VMS_TLB_WRITE], n[VMS_TLB_READONLY],
+		n[VMS_TLB_REFILL], n[VMS_TLB_LPAGE]);
+	kprintf("page faults: %u zero-fill, %u zero frame, %u file, "
+		"%u page cache, %u swap-in (%u ahead), %u large page\n",
+		n[VMS_FAULT_ZEROFILL], n[VMS_FAULT_ZEROPAGE],
+		n[VMS_FAULT_FILE], n[VMS_FAULT_CACHED],
+		n[VMS_FAULT_SWAPIN], n[VMS_FAULT_AHEAD],
+		n[VMS_FAULT_LPAGE]);
+	kprintf("write faults: %u copy-on-write, %u zero frame\n",
+		n[VMS_FAULT_COW], n[VMS_FAULT_ZEROBREAK]);
+	kprintf("paging: %u evicted (%u file), %u cleaned, %u swap reads, "
+		"%u swap writes\n", n[VMS_EVICT], n[VMS_EVICT_FILE],
+		n[VMS_CLEAN], n[VMS_SWAP_READ], n[VMS_SWAP_WRITE]);
+	kprintf("coremap lock: %u acquired, %u contended\n",
+		n[VMS_CMLOCK], n[VMS_CMLOCK_CONTENDED]);
+	kprintf("memory pressure: %u waits for memory, %u processes "
+		"killed\n", n[VMS_ALLOC_WAIT], n[VMS_OOM_KILL]);
+	kprintf("memory: %u pages, %u free, %u free at the lowest\n",
+		vs.vs_pages, vs.vs_free, vs.vs_free_low);
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -468,6 +580,9 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[swapon]  Add a swap device         ",
+	"[swapoff] Remove a swap device      ",
+	"[swap]    List swap devices         ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -539,6 +654,7 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vm] VM statistics                  ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -579,6 +695,9 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "swapon",	cmd_swapon },
+	{ "swapoff",	cmd_swapoff },
+	{ "swap",	cmd_swapinfo },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -588,6 +707,7 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
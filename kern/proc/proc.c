@@ -51,7 +51,9 @@
 #include <pid.h>
 #include <synch_hashtable.h>
 #include <fileops.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <coremap.h>
 
 
 /*
@@ -59,6 +61,12 @@
  */
 struct proc *kproc;
 
+/*
+ * All processes, linked through p_allnext, for the OOM killer.
+ */
+static struct proc *allprocs;
+static struct spinlock allprocs_lock = SPINLOCK_INITIALIZER;
+
 /*
  * Create a proc structure.
  */
@@ -143,6 +151,13 @@ proc_create(const char *name)
 	proc->p_childlist_lock = lock_create(name);
 	proc->p_exit_sem_child = sem_create("wait_sem_child", 0);
 	proc->p_exit_sem_parent = sem_create("wait_sem_parent", 0);
+
+	proc->p_tickets = 0;
+	proc->p_killed = false;
+	spinlock_acquire(&allprocs_lock);
+	proc->p_allnext = allprocs;
+	allprocs = proc;
+	spinlock_release(&allprocs_lock);
 	return proc;
 }
 
@@ -155,6 +170,8 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+	struct proc **pp;
+
 	/*
 	 * You probably want to destroy and null out much of the
 	 * process (particularly the address space) at exit time if
@@ -166,6 +183,14 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+	/* Out of sight of the OOM killer first */
+	spinlock_acquire(&allprocs_lock);
+	for (pp = &allprocs; *pp != proc; pp = &(*pp)->p_allnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = proc->p_allnext;
+	spinlock_release(&allprocs_lock);
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -289,6 +314,218 @@ proc_create_runprogram(const char *name)
 	return proc;
 }
 
+/*
+ * Find user process PID, 0 meaning the current one. allprocs_lock has
+ * to be held; it keeps the process from being destroyed.
+ */
+static
+struct proc *
+proc_find(pid_t pid)
+{
+	struct proc *p;
+
+	KASSERT(spinlock_do_i_hold(&allprocs_lock));
+
+	if (pid == 0) {
+		return curproc == kproc ? NULL : curproc;
+	}
+	for (p = allprocs; p != NULL; p = p->p_allnext) {
+		if (p != kproc && p->PID == pid) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Out of memory: mark the user process with the most resident pages
+ * to be killed. It exits the next time it is on its way back to user
+ * mode, and its memory comes back with it. Processes marked before are
+ * skipped, they are on their way out already.
+ *
+ * Counting the pages scans the coremap, so it is done with allprocs_lock
+ * released: the processes are visited in PID order, taking only the PID
+ * and the address space pointer of the next one under the lock. Only
+ * the pointer is compared while counting, the address space may be
+ * going away. The victim is looked up by PID again to mark it, and is
+ * picked anew if it went away or was killed meanwhile.
+ */
+int
+proc_oom_kill(void)
+{
+	struct proc *p;
+	struct addrspace *as;
+	char name[32];
+	unsigned pages, most;
+	int pid, next, victim;
+
+	while (true) {
+		victim = -1;
+		most = 0;
+		pid = 0;
+		while (true) {
+			/* the candidate with the next PID */
+			next = -1;
+			as = NULL;
+			spinlock_acquire(&allprocs_lock);
+			for (p = allprocs; p != NULL; p = p->p_allnext) {
+				if (p == kproc || p->p_killed ||
+				    p->p_addrspace == NULL || p->PID <= pid) {
+					continue;
+				}
+				if (next < 0 || p->PID < next) {
+					next = p->PID;
+					as = p->p_addrspace;
+				}
+			}
+			spinlock_release(&allprocs_lock);
+			if (next < 0) {
+				break;
+			}
+			pid = next;
+
+			pages = get_resident_count(as);
+			if (pages > most) {
+				victim = pid;
+				most = pages;
+			}
+		}
+		if (victim < 0) {
+			return -1;
+		}
+
+		spinlock_acquire(&allprocs_lock);
+		p = proc_find(victim);
+		if (p != NULL && !p->p_killed) {
+			p->p_killed = true;
+			snprintf(name, sizeof(name), "%s", p->p_name);
+			spinlock_release(&allprocs_lock);
+
+			/* kprintf may sleep */
+			kprintf("Out of memory: killed process %d (%s), %u pages\n",
+				victim, name, most);
+			return victim;
+		}
+		spinlock_release(&allprocs_lock);
+	}
+}
+
+/*
+ * Restrict the threads of process PID to the cpus in MASK (see
+ * thread_setaffinity). The current thread is done last, outside the
+ * locks, as it moves right away.
+ */
+int
+proc_setaffinity(pid_t pid, uint32_t mask)
+{
+	struct proc *p;
+	struct thread *t;
+	unsigned i;
+	bool mine = false;
+	int result = ESRCH;
+
+	spinlock_acquire(&allprocs_lock);
+	p = proc_find(pid);
+	if (p != NULL) {
+		result = 0;
+		spinlock_acquire(&p->p_lock);
+		for (i = 0; i < threadarray_num(&p->p_threads) && result == 0; i++) {
+			t = threadarray_get(&p->p_threads, i);
+			if (t == curthread) {
+				mine = true;
+				continue;
+			}
+			result = thread_setaffinity(t, mask);
+		}
+		spinlock_release(&p->p_lock);
+	}
+	spinlock_release(&allprocs_lock);
+
+	if (result == 0 && mine) {
+		result = thread_setaffinity(curthread, mask);
+	}
+	return result;
+}
+
+/*
+ * The cpu affinity of process PID, that of its first thread.
+ */
+int
+proc_getaffinity(pid_t pid, uint32_t *mask)
+{
+	struct proc *p;
+	int result = ESRCH;
+
+	spinlock_acquire(&allprocs_lock);
+	p = proc_find(pid);
+	if (p != NULL) {
+		result = 0;
+		*mask = THREAD_AFFINITY_ALL;
+		spinlock_acquire(&p->p_lock);
+		if (threadarray_num(&p->p_threads) > 0) {
+			*mask = threadarray_get(&p->p_threads, 0)->t_affinity;
+		}
+		spinlock_release(&p->p_lock);
+	}
+	spinlock_release(&allprocs_lock);
+
+	return result;
+}
+
+/*
+ * Put the threads of process PID in the stride class with TICKETS
+ * tickets each (see thread_settickets); new threads of it get them
+ * too.
+ */
+int
+proc_settickets(pid_t pid, unsigned tickets)
+{
+	struct proc *p;
+	unsigned i;
+	int result = ESRCH;
+
+	if (tickets > THREAD_TICKETS_MAX) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&allprocs_lock);
+	p = proc_find(pid);
+	if (p != NULL) {
+		result = 0;
+		spinlock_acquire(&p->p_lock);
+		p->p_tickets = tickets;
+		for (i = 0; i < threadarray_num(&p->p_threads) && result == 0; i++) {
+			result = thread_settickets(threadarray_get(&p->p_threads, i),
+						   tickets);
+		}
+		spinlock_release(&p->p_lock);
+	}
+	spinlock_release(&allprocs_lock);
+
+	return result;
+}
+
+/*
+ * The stride class tickets of process PID, 0 if it is in the default
+ * class.
+ */
+int
+proc_gettickets(pid_t pid, unsigned *tickets)
+{
+	struct proc *p;
+	int result = ESRCH;
+
+	spinlock_acquire(&allprocs_lock);
+	p = proc_find(pid);
+	if (p != NULL) {
+		result = 0;
+		*tickets = p->p_tickets;
+	}
+	spinlock_release(&allprocs_lock);
+
+	return result;
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
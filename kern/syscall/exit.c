@@ -7,6 +7,7 @@
 #include <proc.h>
 #include <current.h>
 #include <syscall.h>
+#include <addrspace.h>
 
 /*
 --- exit
@@ -31,6 +32,7 @@ void sys_exit(int exitcode) {
 	struct thread* curt = curthread;
 	struct proc* curp = curt->t_proc;
 	struct proc* childp = NULL;
+	struct addrspace* as;
 	//struct thread* childt = NULL;
 
 	// lock process struct
@@ -94,6 +96,12 @@ void sys_exit(int exitcode) {
 	
 	curp->p_returnvalue = exitcode;
 
+	// give the memory back now, the parent may take its time to collect us
+	as = proc_setas(NULL);
+	as_deactivate();
+	if(as != NULL)
+		as_destroy(as);
+
 
 // TODO if smth breaks down in the join mechanism. Use another one here!!!!
 
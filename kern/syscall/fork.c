@@ -120,10 +120,11 @@ int sys_fork(struct trapframe *tf, int32_t *ret){
 
 	// create child process
 	new_proc = proc_create_runprogram(name);
-    	new_proc->p_parent = curp;
 	if (new_proc == NULL) {
-		return -1; 
+		return ENOMEM;
 	}
+    	new_proc->p_parent = curp;
+	new_proc->p_tickets = curp->p_tickets;
 
 	new_pid = new_proc->PID;
 	// check if generated pid is valid
@@ -161,6 +162,10 @@ int sys_fork(struct trapframe *tf, int32_t *ret){
 
 	// Copy the trapframe to the heap so it's available to the child
 	trapf = kmalloc(sizeof(*tf));
+	if (trapf == NULL) {
+		proc_destroy(new_proc);
+		return ENOMEM;
+	}
 	//memcpy(tf,trapf,sizeof(*tf));
 	memcpy(trapf,tf,sizeof(*tf));
 
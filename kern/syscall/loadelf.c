@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <stat.h>
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -73,6 +74,11 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * Without dumbvm nothing is read here. The segment is recorded as
+ * backed by the executable and vm_fault reads each page in from the
+ * file the first time it is touched; the zero-filled part costs
+ * nothing until then either.
  */
 static
 int
@@ -81,8 +87,12 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if OPT_DUMBVM
 	struct iovec iov;
 	struct uio u;
+#else
+	struct stat st;
+#endif
 	int result;
 
 	if (filesize > memsize) {
@@ -90,6 +100,29 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if !OPT_DUMBVM
+	(void)is_executable;
+
+	/* Nothing goes through uiomove, so check for kernel space here */
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	/* Catch a truncated executable now rather than at fault time */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + (off_t)filesize > st.st_size) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx from the file\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_backing(as, vaddr, v, offset, filesize);
+#else
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -143,6 +176,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 
 	return result;
+#endif /* OPT_DUMBVM */
 }
 
 /*
@@ -0,0 +1,121 @@
+#include <types.h>
+#include <copyinout.h>
+#include <current.h>
+#include <proc.h>
+#include <fileops.h>
+#include <syscall.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <lib.h>
+#include <kern/fcntl.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <limits.h>
+#include <vm.h>
+#include <mips/trapframe.h>
+
+
+
+/*
+ * mmap(addr, len, prot, flags, fd, offset). The first four arguments come
+ * in registers. fd is the fifth 32-bit slot on the user stack, and the
+ * 64-bit offset is aligned to the next even slot after it.
+ */
+int sys_mmap(struct trapframe *tf, int32_t *ret){
+
+	// addr is only a hint, and we don't take hints
+	size_t len = (size_t) tf->tf_a1;
+	int prot = (int) tf->tf_a2;
+	int flags = (int) tf->tf_a3;
+	int fd_id;
+	off_t offset;
+	struct vnode *v = NULL;
+	vaddr_t vaddr;
+	int res;
+
+	res = copyin((const_userptr_t)(tf->tf_sp + 16), &fd_id, sizeof(fd_id));
+	if(res){
+		return res;
+	}
+	res = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+	if(res){
+		return res;
+	}
+
+	// see if the arguments make sense
+	if(len == 0 || len > USERSPACETOP){
+		return EINVAL;
+	}
+	if(prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)){
+		return EINVAL;
+	}
+	if((flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0 ||
+	   (flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+	   (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE)){
+		return EINVAL;
+	}
+
+	if(flags & MAP_ANON){
+		// anonymous memory is only shared with nobody
+		if(flags & MAP_SHARED){
+			return EINVAL;
+		}
+	}
+	else{
+		if(offset < 0 || offset % PAGE_SIZE != 0){
+			return EINVAL;
+		}
+
+		// see if the fd_id is valid
+		if(!( fd_id >= 0 && fd_id < __OPEN_MAX  )){
+			return EBADF;
+		}
+		struct file_descriptor* fd = get_fd(curthread->t_proc->p_fd_table, fd_id);
+		if(fd == NULL){
+			return EBADF;
+		}
+
+		// we read the file in any case, and write it if the mapping is shared and writeable
+		if((fd->flags & O_ACCMODE) == O_WRONLY){
+			return EACCES;
+		}
+		if((flags & MAP_SHARED) && (prot & PROT_WRITE) && (fd->flags & O_ACCMODE) != O_RDWR){
+			return EACCES;
+		}
+
+		// and the file has to be one that can be mapped
+		v = fd->vnode;
+		res = VOP_MMAP(v);
+		if(res){
+			return res;
+		}
+	}
+
+	res = as_define_mmap(proc_getas(), ROUNDUP(len, PAGE_SIZE), prot, flags, v, offset, &vaddr);
+	if(res){
+		return res;
+	}
+
+	*ret = (int32_t) vaddr;
+	return 0;
+}
+
+
+
+/*
+ * munmap(addr, len)
+ */
+int sys_munmap(struct trapframe *tf, int32_t *ret){
+
+	vaddr_t vaddr = (vaddr_t) tf->tf_a0;
+	size_t len = (size_t) tf->tf_a1;
+
+	(void)ret;
+
+	if(vaddr % PAGE_SIZE != 0 || len == 0 || vaddr >= USERSPACETOP ||
+	   len > USERSPACETOP - vaddr){
+		return EINVAL;
+	}
+
+	return as_unmap(proc_getas(), vaddr, ROUNDUP(len, PAGE_SIZE));
+}
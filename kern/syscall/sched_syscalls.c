@@ -0,0 +1,59 @@
+#include <types.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <syscall.h>
+
+/*
+ * sched_setaffinity(pid_t pid, unsigned mask): restrict process PID,
+ * 0 for the calling one, to the cpus in MASK, a bit per cpu number.
+ */
+int
+sys_sched_setaffinity(pid_t pid, uint32_t mask)
+{
+	return proc_setaffinity(pid, mask);
+}
+
+/*
+ * sched_getaffinity(pid_t pid, unsigned *mask): copy the cpus process
+ * PID may run on out to MASK.
+ */
+int
+sys_sched_getaffinity(pid_t pid, userptr_t user_mask)
+{
+	uint32_t mask;
+	int result;
+
+	result = proc_getaffinity(pid, &mask);
+	if (result) {
+		return result;
+	}
+	return copyout(&mask, user_mask, sizeof(mask));
+}
+
+/*
+ * sched_settickets(pid_t pid, unsigned tickets): give process PID
+ * TICKETS tickets in the stride class, or put it back in the default
+ * class if TICKETS is 0.
+ */
+int
+sys_sched_settickets(pid_t pid, unsigned tickets)
+{
+	return proc_settickets(pid, tickets);
+}
+
+/*
+ * sched_gettickets(pid_t pid, unsigned *tickets): copy the tickets of
+ * process PID out to TICKETS.
+ */
+int
+sys_sched_gettickets(pid_t pid, userptr_t user_tickets)
+{
+	unsigned tickets;
+	int result;
+
+	result = proc_gettickets(pid, &tickets);
+	if (result) {
+		return result;
+	}
+	return copyout(&tickets, user_tickets, sizeof(tickets));
+}
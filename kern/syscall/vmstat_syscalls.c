@@ -0,0 +1,16 @@
+#include <types.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <vmstat.h>
+
+/*
+ * __vmstat(struct vmstat *vs): copy the VM statistics out to VS.
+ */
+int
+sys___vmstat(userptr_t user_vs)
+{
+	struct vmstat vs;
+
+	vmstat_get(&vs);
+	return copyout(&vs, user_vs, sizeof(vs));
+}
@@ -30,17 +30,20 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Each cpu's timer goes off only when there is something to do:
+ * every hardclock period while threads compete for the cpu, less
+ * often when one runs alone, and for idle cpus only when a timeout is
+ * due. c_hardclocks counts the periods that went by all the same.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -52,12 +55,19 @@
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define IDLE_HARDCLOCKS		HZ	/* Longest an idle cpu sleeps. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Pending timeouts, sorted by deadline.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+static struct timeout *timeouts;
+static struct spinlock timeouts_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * clocksleep() sleepers, woken by their timeouts.
+ */
+static struct wchan *clocksleep_wchan;
+static struct spinlock clocksleep_lock;
 
 /*
  * Setup.
@@ -65,11 +75,113 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	spinlock_init(&clocksleep_lock);
+	clocksleep_wchan = wchan_create("clocksleep");
+	if (clocksleep_wchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
+	}
+}
+
+/* Whether time A is before time B */
+static
+bool
+timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Run the timeouts that are due. The list is looked at without the
+ * lock first, so this costs nothing when there are none.
+ */
+static
+void
+timeout_run(void)
+{
+	struct timespec now;
+	struct timeout *to;
+	void (*func)(void *);
+	void *data;
+
+	if (timeouts == NULL) {
+		return;
+	}
+
+	gettime(&now);
+	spinlock_acquire(&timeouts_lock);
+	while ((to = timeouts) != NULL && !timespec_before(&now, &to->to_when)) {
+		timeouts = to->to_next;
+		to->to_pending = false;
+		func = to->to_func;
+		data = to->to_data;
+		spinlock_release(&timeouts_lock);
+		func(data);
+		spinlock_acquire(&timeouts_lock);
+	}
+	spinlock_release(&timeouts_lock);
+}
+
+/*
+ * Hardclock periods until the first timeout is due, rounded up, at
+ * least 1 and at most MAX.
+ */
+static
+unsigned
+timeout_ticks(unsigned max)
+{
+	struct timespec now, left;
+	unsigned ticks;
+	bool due;
+
+	if (timeouts == NULL) {
+		return max;
+	}
+
+	gettime(&now);
+	spinlock_acquire(&timeouts_lock);
+	if (timeouts == NULL) {
+		spinlock_release(&timeouts_lock);
+		return max;
+	}
+	due = !timespec_before(&now, &timeouts->to_when);
+	if (!due) {
+		timespec_sub(&timeouts->to_when, &now, &left);
 	}
+	spinlock_release(&timeouts_lock);
+
+	if (due) {
+		return 1;
+	}
+	if (left.tv_sec >= max / HZ + 1) {
+		return max;
+	}
+	ticks = left.tv_sec * HZ +
+		DIVROUNDUP((unsigned)left.tv_nsec, 1000000000 / HZ);
+	return ticks < max ? ticks : max;
+}
+
+void
+clock_idle(void)
+{
+	if (curcpu->c_tickless) {
+		/* hardclock keeps it set */
+		return;
+	}
+	curcpu->c_hardclocks += mainbus_timer_elapsed();
+	curcpu->c_tickless = true;
+	mainbus_timer_set(timeout_ticks(IDLE_HARDCLOCKS));
+}
+
+void
+clock_busy(void)
+{
+	if (!curcpu->c_tickless) {
+		return;
+	}
+	curcpu->c_hardclocks += mainbus_timer_elapsed();
+	curcpu->c_tickless = false;
+	mainbus_timer_set(1);
 }
 
 /*
@@ -79,31 +191,133 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
+	timeout_run();
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * This is called on each processor when its timer goes off. The
+ * periods charged are those that went by, which may be more than the
+ * timer was set for if the interrupt was late.
  */
 void
 hardclock(void)
 {
+	unsigned ticks, before;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	ticks = mainbus_timer_elapsed();
+	before = curcpu->c_hardclocks;
+	curcpu->c_hardclocks += ticks;
+
+	timeout_run();
+
+	if (curcpu->c_isidle) {
+		/* Woken for a timeout; sleep on until the next one */
+		mainbus_timer_set(timeout_ticks(IDLE_HARDCLOCKS));
+		return;
+	}
+
+	if (curcpu->c_hardclocks / MIGRATE_HARDCLOCKS !=
+	    before / MIGRATE_HARDCLOCKS) {
 		thread_consider_migration();
 	}
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if (curcpu->c_hardclocks / SCHEDULE_HARDCLOCKS !=
+	    before / SCHEDULE_HARDCLOCKS) {
 		schedule();
 	}
-	thread_yield();
+
+	/*
+	 * Set the timer before thread_tick, which may switch away. That
+	 * also clears the interrupt.
+	 */
+	mainbus_timer_set(timeout_ticks(thread_tick_period()));
+	thread_tick(ticks);
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *data)
+{
+	to->to_func = func;
+	to->to_data = data;
+	to->to_next = NULL;
+	to->to_pending = false;
+}
+
+/* Take TO off the pending list. timeouts_lock has to be held. */
+static
+void
+timeout_unlink(struct timeout *to)
+{
+	struct timeout **p;
+
+	KASSERT(spinlock_do_i_hold(&timeouts_lock));
+
+	for (p = &timeouts; *p != to; p = &(*p)->to_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = to->to_next;
+	to->to_next = NULL;
+	to->to_pending = false;
+}
+
+void
+timeout_add(struct timeout *to, unsigned msecs)
+{
+	struct timespec now, delta;
+	struct timeout **p;
+
+	gettime(&now);
+	delta.tv_sec = msecs / 1000;
+	delta.tv_nsec = (msecs % 1000) * 1000000;
+
+	spinlock_acquire(&timeouts_lock);
+	if (to->to_pending) {
+		timeout_unlink(to);
+	}
+	timespec_add(&now, &delta, &to->to_when);
+
+	/* Behind the timeouts with the same deadline */
+	for (p = &timeouts; *p != NULL; p = &(*p)->to_next) {
+		if (timespec_before(&to->to_when, &(*p)->to_when)) {
+			break;
+		}
+	}
+	to->to_next = *p;
+	*p = to;
+	to->to_pending = true;
+	spinlock_release(&timeouts_lock);
+}
+
+bool
+timeout_del(struct timeout *to)
+{
+	bool pending;
+
+	spinlock_acquire(&timeouts_lock);
+	pending = to->to_pending;
+	if (pending) {
+		timeout_unlink(to);
+	}
+	spinlock_release(&timeouts_lock);
+	return pending;
+}
+
+/*
+ * The timeout of a clocksleep() sleeper. DATA is its flag.
+ */
+static
+void
+clocksleep_wakeup(void *data)
+{
+	bool *done = data;
+
+	spinlock_acquire(&clocksleep_lock);
+	*done = true;
+	wchan_wakeall(clocksleep_wchan, &clocksleep_lock);
+	spinlock_release(&clocksleep_lock);
 }
 
 /*
@@ -112,10 +326,18 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	struct timeout to;
+	bool done = false;
+
+	if (num_secs <= 0) {
+		return;
+	}
+
+	timeout_init(&to, clocksleep_wakeup, &done);
+	spinlock_acquire(&clocksleep_lock);
+	timeout_add(&to, num_secs * 1000);
+	while (!done) {
+		wchan_sleep(clocksleep_wchan, &clocksleep_lock);
 	}
-	spinlock_release(&lbolt_lock);
+	spinlock_release(&clocksleep_lock);
 }
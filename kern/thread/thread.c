@@ -48,6 +48,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <clock.h>
 #include <mainbus.h>
 #include <vnode.h>
 
@@ -57,6 +58,39 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Multi-level feedback queue parameters. The time slice doubles with
+ * each level down. Ages are counted in schedule() calls, which come
+ * every few hardclocks (see clock.c).
+ */
+#define SCHED_LEVELS		4	/* Number of priority levels */
+#define SCHED_SLICE(level)	(1U << (level))	/* Hardclocks per slice */
+#define SCHED_AGE		25	/* Waits before moving up a level */
+#define SCHED_SOLO		4	/* Most hardclocks per tick when alone */
+
+/*
+ * Affinity parameters. A thread that left its cpu less than
+ * SCHED_CACHE_HOT hardclocks ago goes back to it unless it has
+ * SCHED_OVERLOAD more threads than the least loaded cpu; an older one
+ * only if no cpu has less.
+ */
+#define SCHED_CACHE_HOT		2	/* Hardclocks a cache stays warm */
+#define SCHED_OVERLOAD		2	/* Extra threads a warm cpu may have */
+
+/*
+ * Stride class parameters. A stride thread's pass advances by its
+ * stride for every hardclock it runs, and the lowest pass runs next;
+ * the default class as a whole advances by the stride of
+ * THREAD_TICKETS_DEFAULT. Passes wrap around, so they are compared
+ * as signed differences.
+ */
+#define STRIDE1			(1U << 20)
+#define STRIDE(tickets)		(STRIDE1 / (tickets))
+#define PASS_BEFORE(a, b)	((int32_t)((a) - (b)) < 0)
+
+/* Whether thread T may run on cpu C */
+#define THREAD_ALLOWED(t, c)	(((t)->t_affinity & (1U << (c)->c_number)) != 0)
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -69,6 +103,9 @@ DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
 static struct cpuarray allcpus;
 
+/* Body of the per-cpu idle threads */
+static int thread_idle(void *data1, unsigned long data2);
+
 /* Array of all wchans (for debugging purposes) */
 DECLARRAY(wchan);
 DEFARRAY(wchan, /*no inline*/ );
@@ -155,6 +192,17 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields; new threads start at the top */
+	thread->t_level = 0;
+	thread->t_ticks = 0;
+	thread->t_waited = 0;
+	thread->t_background = false;
+	thread->t_lastran = 0;
+	thread->t_affinity = THREAD_AFFINITY_ALL;
+	thread->t_tickets = 0;
+	thread->t_share = 0;
+	thread->t_pass = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 	thread->t_parent = NULL;
 	thread->has_parent = false;
@@ -185,6 +233,8 @@ cpu_create(unsigned hardware_number)
 	if (c == NULL) {
 		panic("cpu_create: Out of memory\n");
 	}
+	/* one bit per cpu in affinity masks */
+	KASSERT(cpuarray_num(&allcpus) < 32);
 
 	c->c_self = c;
 	c->c_hardware_number = hardware_number;
@@ -193,13 +243,24 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	spinlock_init(&c->c_zombies_lock);
 	c->c_hardclocks = 0;
+	c->c_tickless = false;
+	c->c_numframes = 0;
+	c->c_asid_last = 0;
+	c->c_tlbpid = 0;
+	bzero(c->c_vmstat, sizeof(c->c_vmstat));
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	threadlist_init(&c->c_stridequeue);
+	c->c_tickets = 0;
+	c->c_pass = 0;
+	c->c_defpass = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_queued = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -235,11 +296,55 @@ cpu_create(unsigned hardware_number)
 	}
 	c->c_curthread->t_cpu = c;
 
+	/*
+	 * The idle thread. It starts out parked, as if it had been
+	 * switched away from; like a new thread it comes out holding
+	 * the run queue lock (see thread_fork).
+	 */
+	snprintf(namebuf, sizeof(namebuf), "<idle #%d>", c->c_number);
+	c->c_idlethread = thread_create(namebuf);
+	if (c->c_idlethread == NULL) {
+		panic("cpu_create: thread_create failed\n");
+	}
+	result = proc_addthread(kproc, c->c_idlethread);
+	if (result) {
+		panic("cpu_create: proc_addthread:: %s\n", strerror(result));
+	}
+	c->c_idlethread->t_stack = kmalloc(STACK_SIZE);
+	if (c->c_idlethread->t_stack == NULL) {
+		panic("cpu_create: couldn't allocate stack");
+	}
+	thread_checkstack_init(c->c_idlethread);
+	c->c_idlethread->t_cpu = c;
+	c->c_idlethread->t_affinity = 1U << c->c_number;
+	c->c_idlethread->t_background = true;
+	c->c_idlethread->t_state = S_SLEEP;
+	c->c_idlethread->t_wchan_name = "idle";
+	c->c_idlethread->t_iplhigh_count++;
+	switchframe_init(c->c_idlethread, thread_idle, NULL, 0);
+	c->c_outbound = NULL;
+
 	cpu_machdep_init(c);
 
 	return c;
 }
 
+/*
+ * Number of cpus, and the cpu with the given (software) number. Cpus
+ * are never destroyed, so the result may be kept.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned number)
+{
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -318,6 +423,9 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
 	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	curcpu->c_stridequeue.tl_count = 0;
+	curcpu->c_stridequeue.tl_head.tln_next = &curcpu->c_stridequeue.tl_tail;
+	curcpu->c_stridequeue.tl_tail.tln_prev = &curcpu->c_stridequeue.tl_head;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -447,6 +555,256 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put a thread on a cpu's run queue, which has to be locked. The run
+ * queue is kept sorted by level: the thread goes behind the threads of
+ * its own and higher levels, so the head is always the one to run next
+ * and each level is served round-robin.
+ *
+ * Threads with tickets go on the stride queue instead, sorted by pass,
+ * behind those with the same pass. This is where a change of tickets
+ * takes effect; a thread joining the class starts at the cpu's virtual
+ * time, with neither credit nor debt.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+	unsigned tickets;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	tickets = t->t_tickets;
+	if (tickets != t->t_share) {
+		if (t->t_share == 0) {
+			t->t_pass = c->c_pass;
+		}
+		t->t_share = tickets;
+	}
+
+	if (t->t_share != 0) {
+		c->c_tickets += t->t_share;
+		for (tln = c->c_stridequeue.tl_tail.tln_prev;
+		     tln->tln_self != NULL; tln = tln->tln_prev) {
+			if (!PASS_BEFORE(t->t_pass, tln->tln_self->t_pass)) {
+				threadlist_insertafter(&c->c_stridequeue,
+						       tln->tln_self, t);
+				return;
+			}
+		}
+		threadlist_addhead(&c->c_stridequeue, t);
+		return;
+	}
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_self != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_level <= t->t_level) {
+			threadlist_insertafter(&c->c_runqueue, tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/* Take queued thread T off cpu C's run queue, which has to be locked */
+static
+void
+runqueue_remove(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (t->t_share != 0) {
+		threadlist_remove(&c->c_stridequeue, t);
+		c->c_tickets -= t->t_share;
+	}
+	else {
+		threadlist_remove(&c->c_runqueue, t);
+	}
+}
+
+/* Number of threads queued on cpu C, of both classes */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	return c->c_runqueue.tl_count + c->c_stridequeue.tl_count;
+}
+
+/*
+ * The pass of the default class on cpu C, whose run queue has to be
+ * locked. The class is not charged while it has nothing to run, so it
+ * may have fallen behind the cpu's virtual time; that is not credit.
+ */
+static
+uint32_t
+runqueue_defpass(struct cpu *c)
+{
+	if (PASS_BEFORE(c->c_defpass, c->c_pass)) {
+		c->c_defpass = c->c_pass;
+	}
+	return c->c_defpass;
+}
+
+/*
+ * Take the thread to run next off cpu C's run queue, which has to be
+ * locked: the head of the stride queue if its pass is below that of
+ * the default class, the head of the feedback queue otherwise. The
+ * cpu's virtual time moves up to the pass of the one chosen.
+ */
+static
+struct thread *
+runqueue_next(struct cpu *c)
+{
+	struct thread *t;
+	uint32_t defpass;
+
+	defpass = runqueue_defpass(c);
+	t = c->c_stridequeue.tl_head.tln_next->tln_self;
+	if (t != NULL && (threadlist_isempty(&c->c_runqueue) ||
+			  PASS_BEFORE(t->t_pass, defpass))) {
+		runqueue_remove(c, t);
+		if (PASS_BEFORE(c->c_pass, t->t_pass)) {
+			c->c_pass = t->t_pass;
+		}
+		return t;
+	}
+
+	t = threadlist_remhead(&c->c_runqueue);
+	if (t != NULL) {
+		c->c_pass = defpass;
+	}
+	return t;
+}
+
+/*
+ * Carry the pass of thread T over from cpu FROM to cpu TO, keeping
+ * how far ahead of or behind FROM's virtual time it was. The virtual
+ * times are read without locks; being a hardclock off only costs a
+ * little precision.
+ */
+static
+void
+stride_move(struct thread *t, struct cpu *from, struct cpu *to)
+{
+	if (t->t_share != 0) {
+		t->t_pass = t->t_pass - from->c_pass + to->c_pass;
+	}
+}
+
+/*
+ * Wake an idle cpu, if there is one, to steal a thread just queued on
+ * the busy cpu BUSY rather than leave it waiting there (see
+ * thread_steal). c_isidle is only read, without the lock, as a hint.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/* How busy cpu C is: its queued threads and the one it runs, if any */
+static
+unsigned
+cpu_load(struct cpu *c)
+{
+	return runqueue_count(c) + (c->c_isidle ? 0 : 1);
+}
+
+/*
+ * Choose the cpu thread T should be queued on: its last cpu, t_cpu,
+ * while the cache there may still hold its working set and that cpu
+ * is not overloaded (see SCHED_CACHE_HOT); otherwise the least loaded
+ * cpu it may run on. Loads are read without locks, as hints.
+ */
+static
+struct cpu *
+thread_pick_cpu(struct thread *t)
+{
+	struct cpu *c, *best, *last;
+	unsigned i, numcpus, load, bestload;
+
+	best = NULL;
+	bestload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!THREAD_ALLOWED(t, c)) {
+			continue;
+		}
+		load = cpu_load(c);
+		if (best == NULL || load < bestload) {
+			best = c;
+			bestload = load;
+		}
+	}
+	KASSERT(best != NULL);
+
+	last = t->t_cpu;
+	if (last != NULL && THREAD_ALLOWED(t, last)) {
+		load = cpu_load(last);
+		if (load <= bestload) {
+			return last;
+		}
+		if (last->c_hardclocks - t->t_lastran < SCHED_CACHE_HOT &&
+		    load <= bestload + SCHED_OVERLOAD) {
+			return last;
+		}
+	}
+	return best;
+}
+
+/*
+ * Queue thread T, which is on no list and not running anywhere, on
+ * the cpu thread_pick_cpu chooses. Our own run queue must not be
+ * locked.
+ */
+static
+void
+thread_send(struct thread *t)
+{
+	struct cpu *c;
+
+	c = thread_pick_cpu(t);
+	spinlock_acquire(&c->c_runqueue_lock);
+	stride_move(t, t->t_cpu, c);
+	t->t_cpu = c;
+	runqueue_insert(c, t);
+	if (c->c_isidle) {
+		ipi_send(c, IPI_UNIDLE);
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Send off the thread that left this cpu on the last switch, now that
+ * we are off its stack. Called after every switch, with interrupts
+ * off and the run queue unlocked.
+ */
+static
+void
+thread_send_outbound(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_outbound;
+	if (t != NULL) {
+		curcpu->c_outbound = NULL;
+		thread_send(t);
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -456,7 +814,7 @@ static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
-	struct cpu *targetcpu;
+	struct cpu *targetcpu, *c;
 	bool isidle;
 
 	/* Lock the run queue of the target thread's cpu. */
@@ -468,10 +826,31 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+		/*
+		 * Choose where it wakes up. With its last cpu locked the
+		 * thread is known to be off that cpu's stack, unless the
+		 * cpu went idle on it; then it has to go back there.
+		 */
+		if (target != targetcpu->c_curthread) {
+			c = thread_pick_cpu(target);
+			if (c != targetcpu) {
+				spinlock_release(&targetcpu->c_runqueue_lock);
+				targetcpu = c;
+				target->t_cpu = c;
+				spinlock_acquire(&targetcpu->c_runqueue_lock);
+			}
+		}
+
+		/* A stride thread's pass was kept relative while it slept */
+		if (target->t_share != 0) {
+			target->t_pass += targetcpu->c_pass;
+		}
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_waited = 0;
+	runqueue_insert(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -479,6 +858,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -524,6 +906,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
 
 	// added for ASST1		
 	/* store some more information in the current and child thread if child thread is joinable */ 
@@ -561,6 +944,7 @@ thread_fork(const char *name,
 	if (proc == NULL) {
 		proc = curthread->t_proc;
 	}
+	newthread->t_tickets = proc->p_tickets;
 	result = proc_addthread(proc, newthread);
 	if (result) {
 		/* thread_destroy will clean up the stack */
@@ -584,6 +968,81 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * The last thread on list TL of VICTIM's run queue that may run here,
+ * NULL if there is none. Skips the victim's curthread: the victim went
+ * idle in it and it was woken up before the victim unidled, so it is
+ * still running on its stack. See thread_consider_migration.
+ */
+static
+struct thread *
+thread_steal_candidate(struct threadlist *tl, struct cpu *victim)
+{
+	struct thread *t;
+
+	THREADLIST_FORALL_REV(t, *tl) {
+		if (t != victim->c_curthread && THREAD_ALLOWED(t, curcpu)) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Work stealing. Called by a cpu that ran out of threads, with its
+ * own run queue unlocked. Takes the thread at the tail of the longest
+ * other run queue, the one that would wait there the longest, and
+ * queues it here. The queue lengths are read without locks, as hints,
+ * so only the victim's queue is locked, and never together with ours.
+ * Returns true if a thread was stolen.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && runqueue_count(c) > most) {
+			most = runqueue_count(c);
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = thread_steal_candidate(&victim->c_runqueue, victim);
+	if (t == NULL) {
+		t = thread_steal_candidate(&victim->c_stridequeue, victim);
+	}
+	if (t != NULL) {
+		runqueue_remove(victim, t);
+		stride_move(t, victim, curcpu->c_self);
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_insert(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -631,8 +1090,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. Unless
+	 * we may not run here any more; then there is always something
+	 * to do, if only switching to the idle thread.
+	 */
+	if (newstate == S_READY && runqueue_count(curcpu->c_self) == 0 &&
+	    THREAD_ALLOWED(cur, curcpu)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -643,9 +1107,38 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		if (!THREAD_ALLOWED(cur, curcpu)) {
+			/*
+			 * It has to move to another cpu. It can't be
+			 * queued there until we are off its stack, so
+			 * the next thread sends it (see
+			 * thread_send_outbound).
+			 */
+			curcpu->c_outbound = cur;
+			break;
+		}
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		if (wc == NULL) {
+			/* The idle thread parks on no list */
+			KASSERT(cur == curcpu->c_idlethread);
+			cur->t_wchan_name = "idle";
+			break;
+		}
+		/*
+		 * Blocking before the slice is used up is what
+		 * interactive and I/O bound threads do: move up a
+		 * level and start a fresh slice there.
+		 */
+		if (cur->t_level > 0 && !cur->t_background) {
+			cur->t_level--;
+		}
+		cur->t_ticks = 0;
+		/* Keep its pass relative while it sleeps; it may wake elsewhere */
+		if (cur->t_share != 0) {
+			cur->t_pass -= curcpu->c_pass;
+		}
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -664,6 +1157,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastran = curcpu->c_hardclocks;
 
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
@@ -685,14 +1179,22 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_next(curcpu->c_self);
+		if (next == NULL && curcpu->c_outbound != NULL) {
+			/* Don't idle on the stack of a leaving thread */
+			next = curcpu->c_idlethread;
+		}
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				clock_idle();
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	clock_busy();
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -761,6 +1263,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send off the thread we switched away from, if it is leaving. */
+	thread_send_outbound();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -771,6 +1276,24 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	splx(spl);
 }
 
+/*
+ * The idle thread of a cpu. It only runs when thread_switch picks it
+ * for a thread leaving the cpu with nothing else to run, and parks
+ * again straight away, so the cpu idles on its stack.
+ */
+static
+int
+thread_idle(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		thread_switch(S_SLEEP, NULL, NULL);
+	}
+	return 0;
+}
+
 /*
  * This function is where new threads start running. The arguments
  * ENTRYPOINT, DATA1, and DATA2 are passed through from thread_fork.
@@ -794,6 +1317,9 @@ thread_startup(int (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send off the thread we switched away from, if it is leaving. */
+	thread_send_outbound();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -943,15 +1469,307 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
+ *
+ * The run queue is a multi-level feedback queue, kept sorted by level
+ * (see runqueue_insert). Threads are demoted by thread_tick when they
+ * use up their slice and promoted when they block (see thread_switch).
+ * What is left to do here is aging: a thread that has been waiting for
+ * SCHED_AGE calls moves up a level, so CPU bound threads at the bottom
+ * cannot be starved by a stream of higher ones.
+ *
+ * Threads whose affinity was changed while they were queued here, and
+ * that may no longer run here, are also sent to a cpu they may run on;
+ * those whose tickets were changed are queued again, which moves them
+ * to the queue of their new class.
  */
 
+/*
+ * Take the threads on list TL of this cpu's run queue that may no
+ * longer run here off it, onto LEAVING, and those whose tickets were
+ * changed onto REFILE.
+ */
+static
+void
+schedule_sift(struct threadlist *tl, struct threadlist *leaving,
+	      struct threadlist *refile)
+{
+	struct thread *t, *nextt;
+
+	for (t = tl->tl_head.tln_next->tln_self; t != NULL; t = nextt) {
+		nextt = t->t_listnode.tln_next->tln_self;
+		/* see thread_steal about curthread */
+		if (!THREAD_ALLOWED(t, curcpu) && t != curcpu->c_curthread) {
+			runqueue_remove(curcpu->c_self, t);
+			threadlist_addtail(leaving, t);
+		}
+		else if (t->t_tickets != t->t_share) {
+			runqueue_remove(curcpu->c_self, t);
+			threadlist_addtail(refile, t);
+		}
+	}
+}
+
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist aged, leaving, refile;
+	struct thread *t;
+	bool moved = false;
+
+	threadlist_init(&aged);
+	threadlist_init(&leaving);
+	threadlist_init(&refile);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	schedule_sift(&curcpu->c_runqueue, &leaving, &refile);
+	schedule_sift(&curcpu->c_stridequeue, &leaving, &refile);
+	while ((t = threadlist_remhead(&refile)) != NULL) {
+		runqueue_insert(curcpu->c_self, t);
+	}
+
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		if (t->t_background || t->t_level == 0) {
+			continue;
+		}
+		if (++t->t_waited >= SCHED_AGE) {
+			t->t_level--;
+			t->t_ticks = 0;
+			t->t_waited = 0;
+			moved = true;
+		}
+	}
+
+	/* Re-sort, keeping the order within each level */
+	if (moved) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+			threadlist_addtail(&aged, t);
+		}
+		while ((t = threadlist_remhead(&aged)) != NULL) {
+			runqueue_insert(curcpu->c_self, t);
+		}
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&aged);
+	threadlist_cleanup(&refile);
+
+	while ((t = threadlist_remhead(&leaving)) != NULL) {
+		thread_send(t);
+	}
+	threadlist_cleanup(&leaving);
+}
+
+/*
+ * Time slice accounting. A thread that has used up the slice of its
+ * level drops a level and yields to the others; one that still has
+ * slice left keeps the cpu unless a thread of a higher level is
+ * waiting. TICKS is the number of hardclock periods since the last
+ * tick, which may be more than one (see thread_tick_period).
+ *
+ * The hardclock is also charged to the running thread's pass if it is
+ * in the stride class, or to the default class's otherwise. A stride
+ * thread keeps the cpu only while its pass is still the lowest, and
+ * a thread of the default class is preempted by a stride thread whose
+ * pass has fallen below that of the class.
+ */
+void
+thread_tick(unsigned ticks)
+{
+	struct cpu *c = curcpu->c_self;
+	struct thread *cur = curthread;
+	struct thread *next;
+	uint32_t defpass;
+	bool preempt;
+
+	/* Nothing to charge while idle */
+	if (curcpu->c_isidle || cur == curcpu->c_idlethread) {
+		return;
+	}
+
+	/* Its affinity changed and it may not run here any more */
+	if (!THREAD_ALLOWED(cur, curcpu)) {
+		thread_yield();
+		return;
+	}
+
+	if (cur->t_share != 0) {
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (PASS_BEFORE(c->c_pass, cur->t_pass)) {
+			c->c_pass = cur->t_pass;
+		}
+		cur->t_pass += ticks * STRIDE(cur->t_share);
+		next = c->c_stridequeue.tl_head.tln_next->tln_self;
+		preempt = next != NULL && PASS_BEFORE(next->t_pass, cur->t_pass);
+		if (!threadlist_isempty(&c->c_runqueue) &&
+		    PASS_BEFORE(runqueue_defpass(c), cur->t_pass)) {
+			preempt = true;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+
+		if (preempt) {
+			thread_yield();
+		}
+		return;
+	}
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	defpass = runqueue_defpass(c);
+	c->c_pass = defpass;
+	c->c_defpass = defpass + ticks * STRIDE(THREAD_TICKETS_DEFAULT);
+	spinlock_release(&c->c_runqueue_lock);
+
+	cur->t_ticks += ticks;
+	if (cur->t_ticks >= SCHED_SLICE(cur->t_level)) {
+		if (cur->t_level < SCHED_LEVELS - 1) {
+			cur->t_level++;
+		}
+		cur->t_ticks = 0;
+		thread_yield();
+		return;
+	}
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	next = c->c_runqueue.tl_head.tln_next->tln_self;
+	preempt = next != NULL && next->t_level < cur->t_level;
+	next = c->c_stridequeue.tl_head.tln_next->tln_self;
+	if (next != NULL && PASS_BEFORE(next->t_pass, c->c_defpass)) {
+		preempt = true;
+	}
+	spinlock_release(&c->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * While other threads wait for this cpu it takes a tick every
+ * hardclock period, so they are let on in time. A thread alone on the
+ * cpu has nobody to yield to: ticking it until its slice is up, but
+ * at most every SCHED_SOLO periods, is enough. A thread queued here
+ * meanwhile may wait that long for its turn; the run queue is read
+ * without the lock, as a hint.
+ */
+unsigned
+thread_tick_period(void)
+{
+	struct thread *cur = curthread;
+	unsigned left;
+
+	if (runqueue_count(curcpu->c_self) > 0 ||
+	    cur == curcpu->c_idlethread || !THREAD_ALLOWED(cur, curcpu)) {
+		return 1;
+	}
+	if (cur->t_share != 0) {
+		return SCHED_SOLO;
+	}
+	left = cur->t_ticks < SCHED_SLICE(cur->t_level) ?
+		SCHED_SLICE(cur->t_level) - cur->t_ticks : 1;
+	return left < SCHED_SOLO ? left : SCHED_SOLO;
+}
+
+/*
+ * Background threads sit on the lowest level for good: they are not
+ * promoted when they block and do not age, so they run only when the
+ * cpu has nothing else to do.
+ */
+void
+thread_set_background(void)
+{
+	curthread->t_background = true;
+	curthread->t_level = SCHED_LEVELS - 1;
+	curthread->t_ticks = 0;
+}
+
+int
+thread_setaffinity(struct thread *t, uint32_t mask)
+{
+	unsigned numcpus;
+	uint32_t present;
+
+	numcpus = cpuarray_num(&allcpus);
+	present = numcpus >= 32 ? THREAD_AFFINITY_ALL : (1U << numcpus) - 1;
+	if ((mask & present) == 0) {
+		return EINVAL;
+	}
+	t->t_affinity = mask;
+
+	if (t == curthread && !THREAD_ALLOWED(t, curcpu)) {
+		/* thread_switch hands it over to a cpu it may run on */
+		thread_yield();
+	}
+	return 0;
+}
+
+int
+thread_settickets(struct thread *t, unsigned tickets)
+{
+	if (tickets > THREAD_TICKETS_MAX) {
+		return EINVAL;
+	}
+	/* runqueue_insert or schedule pick it up */
+	t->t_tickets = tickets;
+	return 0;
+}
+
+/*
+ * Cross-cpu fairness for the stride class. Each cpu shares its time
+ * out among the tickets queued on it, so a ticket is worth more on a
+ * cpu with fewer of them. Called from thread_consider_migration: moves
+ * a queued stride thread from here to the cpu with the fewest tickets
+ * if that narrows the gap between the two, which it does if the
+ * thread has fewer tickets than the gap. Ticket counts are read
+ * without locks, as hints.
+ */
+static
+void
+thread_balance_tickets(void)
+{
+	struct cpu *c, *best;
+	struct thread *t;
+	unsigned i, numcpus, gap;
+
+	best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self &&
+		    (best == NULL || c->c_tickets < best->c_tickets)) {
+			best = c;
+		}
+	}
+	if (best == NULL || curcpu->c_tickets <= best->c_tickets) {
+		return;
+	}
+	gap = curcpu->c_tickets - best->c_tickets;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	THREADLIST_FORALL_REV(t, curcpu->c_stridequeue) {
+		/* see thread_steal about curthread */
+		if (t != curthread && THREAD_ALLOWED(t, best) &&
+		    t->t_share < gap) {
+			break;
+		}
+	}
+	if (t != NULL) {
+		runqueue_remove(curcpu->c_self, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (t == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&best->c_runqueue_lock);
+	stride_move(t, curcpu->c_self, best);
+	t->t_cpu = best;
+	runqueue_insert(best, t);
+	DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u, %u tickets",
+	      t->t_name, curcpu->c_number, best->c_number, t->t_share);
+	if (best->c_isidle) {
+		ipi_send(best, IPI_UNIDLE);
+	}
+	spinlock_release(&best->c_runqueue_lock);
 }
 
 /*
@@ -961,6 +1779,13 @@ schedule(void)
  * CPU is busy and other CPUs are idle, or less busy, it should move
  * threads across to those other other CPUs.
  *
+ * Idle CPUs don't wait for this; they steal work themselves (see
+ * thread_steal). What is left here is evening out CPUs that are all
+ * busy. The queue lengths are read without locks, as hints, so this
+ * doesn't lock every queue on every call; the queues are locked once
+ * threads are actually moved. Stride threads are then evened out by
+ * their tickets (see thread_balance_tickets).
+ *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
  * which is fairly slow. The tradeoff between this performance loss
@@ -984,16 +1809,15 @@ thread_consider_migration(void)
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += runqueue_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runqueue_count(c);
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (my_count <= one_share) {
+		thread_balance_tickets();
 		return;
 	}
 
@@ -1001,10 +1825,19 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
+		/* the queue may have shrunk since we looked */
 		t = threadlist_remtail(&curcpu->c_runqueue);
+		if (t == NULL) {
+			t = curcpu->c_stridequeue.tl_tail.tln_prev->tln_self;
+			if (t == NULL) {
+				break;
+			}
+			runqueue_remove(curcpu->c_self, t);
+		}
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
+	to_send = victims.tl_count;
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
@@ -1012,7 +1845,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (runqueue_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -1041,9 +1874,16 @@ thread_consider_migration(void)
 				to_send--;
 				continue;
 			}
+			/* Nor may threads go where they may not run */
+			if (!THREAD_ALLOWED(t, c)) {
+				threadlist_addtail(&victims, t);
+				to_send--;
+				continue;
+			}
 
+			stride_move(t, curcpu->c_self, c);
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_insert(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1067,13 +1907,15 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_insert(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
 
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
+
+	thread_balance_tickets();
 }
 
 ////////////////////////////////////////////////////////////
@@ -1286,13 +2128,14 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_MAX || n == TLBSHOOTDOWN_ALL) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	target->c_shootdown_queued++;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1300,11 +2143,87 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Carry out the TLB shootdowns queued on this cpu. Call with the IPI
+ * lock held.
+ */
+static
+void
+tlbshootdown_service(void)
+{
+	int i;
+
+	if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
+		vm_tlbshootdown_all();
+	}
+	else {
+		for (i=0; i<curcpu->c_numshootdown; i++) {
+			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		}
+	}
+	curcpu->c_numshootdown = 0;
+	curcpu->c_shootdown_done = curcpu->c_shootdown_queued;
+	curcpu->c_ipi_pending &= ~((uint32_t)1 << IPI_TLBSHOOTDOWN);
+}
+
+/*
+ * Send MAPPING to the other cpus that may have it in their TLB and
+ * wait until all of them have dropped it, so the caller can reuse the
+ * page. While waiting we serve shootdowns sent to us: two cpus shooting
+ * at each other with interrupts off would otherwise wait forever.
+ */
+void
+ipi_tlbshootdown_sync(const struct tlbshootdown *mapping)
+{
+	unsigned i, num;
+	uint32_t targets = 0, seq, done;
+	struct cpu *c;
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+
+	num = cpuarray_num(&allcpus);
+	KASSERT(num <= 32);
+
+	for (i=0; i < num; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self &&
+		    vm_tlbshootdown_needed(mapping, c->c_number)) {
+			ipi_tlbshootdown(c, mapping);
+			targets |= (uint32_t)1 << i;
+		}
+	}
+
+	for (i=0; i < num; i++) {
+		if ((targets & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+
+		spinlock_acquire(&c->c_ipi_lock);
+		seq = c->c_shootdown_queued;
+		done = c->c_shootdown_done;
+		spinlock_release(&c->c_ipi_lock);
+
+		while ((int32_t)(done - seq) < 0) {
+			spinlock_acquire(&curcpu->c_ipi_lock);
+			if (curcpu->c_ipi_pending & (1U << IPI_TLBSHOOTDOWN)) {
+				tlbshootdown_service();
+			}
+			spinlock_release(&curcpu->c_ipi_lock);
+
+			spinlock_acquire(&c->c_ipi_lock);
+			done = c->c_shootdown_done;
+			spinlock_release(&c->c_ipi_lock);
+		}
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
-	int i;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
@@ -1333,15 +2252,7 @@ interprocessor_interrupt(void)
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
-		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
-			vm_tlbshootdown_all();
-		}
-		else {
-			for (i=0; i<curcpu->c_numshootdown; i++) {
-				vm_tlbshootdown(&curcpu->c_shootdown[i]);
-			}
-		}
-		curcpu->c_numshootdown = 0;
+		tlbshootdown_service();
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -241,15 +241,15 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mappings are paged in and out a page at a time with
+ * VOP_READ and VOP_WRITE, which none of our devices are made for.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
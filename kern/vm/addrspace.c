@@ -36,6 +36,9 @@
 #include <coremap.h>
 #include <diskmap.h>
 #include <current.h>
+#include <vnode.h>
+#include <pagetable.h>
+#include <kern/mman.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -53,8 +56,22 @@ as_create(void)
 		return NULL;
 	}
     //segment table is inside the struct
-    //page table is a page
-	as->page_table = (struct page_table_entry*)alloc_kpages(1);
+    for(int i = 0; i < 4; i++) {
+        as->segment_table[i].valid = 0;
+        as->segment_table[i].shared = 0;
+        as->segment_table[i].vnode = NULL;
+    }
+    for(int i = 0; i < MMAP_MAX; i++) {
+        as->mmap_table[i].valid = 0;
+        as->mmap_table[i].vnode = NULL;
+    }
+    //no address space IDs yet, they are handed out by as_activate
+    for(int i = 0; i < MAXCPUS; i++)
+        as->as_asid[i] = 0;
+    if(pt_create(as)) {
+        kfree(as);
+        return NULL;
+    }
     //ignore permissions should be zero
 
 
@@ -76,7 +93,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 
     //copy over segment table
-	int i,j;
+	int i;
 	for(i = 0; i < 4; i++) {
         if(old->segment_table[i].valid) {
             newas->segment_table[i].start = old->segment_table[i].start;
@@ -86,76 +103,179 @@ as_copy(struct addrspace *old, struct addrspace **ret)
             newas->segment_table[i].write = old->segment_table[i].write;
             newas->segment_table[i].execute = old->segment_table[i].execute;
             newas->segment_table[i].index = old->segment_table[i].index;
+            //pages the parent never touched are still read from the file
+            newas->segment_table[i].vnode = old->segment_table[i].vnode;
+            newas->segment_table[i].file_offset = old->segment_table[i].file_offset;
+            newas->segment_table[i].file_size = old->segment_table[i].file_size;
+            if(newas->segment_table[i].vnode != NULL)
+                VOP_INCREF(newas->segment_table[i].vnode);
             if(i == SG_DATA_BSS)
                 set_heap_base(newas,old->segment_table[i].end);
         }
     }
 
-    vaddr_t addr;
-    
-    //loop thru 1st lvl page table
-    for(i = 0; i < 1024; i++)
-        if(old->page_table[i].valid) {
-            //if 1st lvl page table is valid, alloc_kpages a page for the newas' copy of the 2nd lvl page table
-            addr = alloc_kpages(1);
+    //and the mmap regions. pages of shared ones end up in both processes
+    //below, and a write does not copy them
+    for(i = 0; i < MMAP_MAX; i++) {
+        newas->mmap_table[i] = old->mmap_table[i];
+        if(newas->mmap_table[i].valid && newas->mmap_table[i].vnode != NULL)
+            VOP_INCREF(newas->mmap_table[i].vnode);
+    }
+
+    vaddr_t addr, vaddr;
+    struct page_table_entry *old_pte, *new_pte;
+    struct pt_iter it;
+
+    //loop thru the parent's pages
+    pt_iter_init(&it, old);
+    while((old_pte = pt_iter_next(&it, &vaddr)) != NULL) {
+        new_pte = pt_lookup_create(newas, vaddr);
+        if(new_pte == NULL) {
+            as_destroy(newas);
+            return ENOMEM;
+        }
+        //don't race with the page being written out to swap
+        acquire_cm_lock();
+        while(old_pte->busy) {
+            release_cm_lock();
+            vm_wait_page(old_pte);
+            acquire_cm_lock();
+        }
+        //a page of the page cache may have been dropped while we waited
+        if(!old_pte->valid) {
+            release_cm_lock();
+            continue;
+        }
+        // if the page is on disk, bring it back in for the parent first,
+        // so both processes can share the frame
+        if(old_pte->on_disk) {
+            release_cm_lock();
+            addr = vm_alloc_page();
             if(!addr) {
-                //TODO set priority level
+                as_destroy(newas);
                 return ENOMEM;
             }
-            newas->page_table[i].index = addr >> 12;
-            newas->page_table[i].valid = 1;
-            //loop thru 2nd lvl page table
-            for(j = 0; j < 1024; j++)
-                if(((struct page_table_entry *)(old->page_table[i].index << 12))[j].valid) {
-                    //if 2nd lvl page table is valid, alloc_kpages a page for the newas' copy of the page
-                    addr = alloc_kpages(1);
-                    if(!addr) {
-                        //TODO: set priority level
-                        return ENOMEM;
-                    }
-                    ((struct page_table_entry *)(newas->page_table[i].index << 12))[j].index = addr >> 12;
-                    // if the page is on disk, load it in
-                    if(((struct page_table_entry *)(old->page_table[i].index << 12))[j].on_disk) {
-                        if(read_page(((struct page_table_entry *)(old->page_table[i].index << 12))[j].index, addr)) {
-                            return EFAULT;
-                        }            
-                    } else {
-                        //memcpy the page using kvaddrs
-                        memcpy((void*)(addr), (void*)(((struct page_table_entry *)(old->page_table[i].index << 12))[j].index << 12), PAGE_SIZE);
-                    }
-                    //set page table on-disk bit to false
-                    ((struct page_table_entry *)(newas->page_table[i].index << 12))[j].on_disk = 0;
-                    //set page table valid
-                    ((struct page_table_entry *)(newas->page_table[i].index << 12))[j].valid = 1;
-                    //set coremap reverse lookup
-                    set_lookup(get_page_index(addr),
-                               (struct page_table_entry *)(newas->page_table[i].index << 12));
-                    //unset coremap kernel bit
-                    set_user_page(get_page_index(addr));
-                }
+            if(read_page(old_pte->index, addr)) {
+                free_kpages(addr);
+                as_destroy(newas);
+                return EFAULT;
+            }
+            acquire_cm_lock();
+            set_swap_slot(get_page_index(addr), old_pte->index);
+            old_pte->index = addr >> 12;
+            old_pte->on_disk = 0;
+            old_pte->dirty = 0;
+            set_lookup(get_page_index(addr), old, old_pte, vaddr);
+            set_user_page(get_page_index(addr));
         }
+        //share the frame copy-on-write. the first write of either
+        //process copies it in vm_fault. once shared it is not paged out.
+        //the zero frame is not counted, it stays around anyway
+        if(!vm_is_zero_page(old_pte))
+            inc_refcount(get_page_index(old_pte->index << 12));
+        release_cm_lock();
+        new_pte->index = old_pte->index;
+        new_pte->dirty = old_pte->dirty;
+        new_pte->on_disk = 0;
+        pt_set_valid(newas, vaddr, new_pte, true);
+    }
+
+    //the parent may still have writable tlb entries for the now shared pages,
+    //here and on every cpu it ran on before
+    vm_tlbflush_as(old);
 
 	*ret = newas;
 	return 0;
 }
 
+/*
+ * Let go of the page at VADDR behind PTE: give its swap slot back, or
+ * drop our reference to its frame. A dirty page of a shared mapping is
+ * written back to its file first. The entry is left invalid.
+ */
+static
+void
+as_release_page(struct addrspace *as, vaddr_t vaddr, struct page_table_entry *pte)
+{
+    struct segment_table_entry *region;
+    unsigned int slot;
+    vaddr_t addr;
+    bool dirty;
+
+    //let a pageout of this page finish first
+    acquire_cm_lock();
+    while(pte->busy) {
+        release_cm_lock();
+        vm_wait_page(pte);
+        acquire_cm_lock();
+    }
+    if(!pte->valid) {
+        //a page of the page cache, dropped while we waited
+        release_cm_lock();
+        return;
+    }
+    if(pte->on_disk) {
+        slot = pte->index;
+        pte->index = 0;
+        pte->on_disk = 0;
+        pt_set_valid(as, vaddr, pte, false);
+        release_cm_lock();
+        //give the swap slot back
+        dm_acquire_lock();
+        dm_set_free(slot);
+        dm_release_lock();
+        return;
+    }
+    if(vm_is_zero_page(pte)) {
+        //nothing of ours in there
+        pte->index = 0;
+        pt_set_valid(as, vaddr, pte, false);
+        release_cm_lock();
+        return;
+    }
+    addr = (vaddr_t)pte->index << 12;
+    dirty = pte->dirty;
+    //make sure the clock can't pick the page through us anymore
+    if(get_lookup(get_page_index(addr)) == pte)
+        set_lookup(get_page_index(addr), NULL, NULL, 0);
+    pte->index = 0;
+    pte->dirty = 0;
+    pt_set_valid(as, vaddr, pte, false);
+    release_cm_lock();
+
+    region = as_find_mmap(as, vaddr);
+    if(dirty && region != NULL && region->shared) {
+        //there is nobody left to tell if this fails
+        (void)vm_page_write_file(region->vnode,
+                                 region->file_offset + (vaddr - region->start), addr);
+    }
+    free_kpages(addr);
+}
+
 void
 as_destroy(struct addrspace *as)
 {
-    //loop thru 1st lvl page table
-    int i,j;
-    for(i = 0; i < 1024; i++)
-        if(as->page_table[i].valid) {
-            //if 1st lvl page table entry is valid, loop thru 2nd lvl page table entry
-            for(j = 0; j < 1024; j++)
-                if(((struct page_table_entry *)(as->page_table[i].index << 12))[j].valid)
-                    //if 2nd lvl page table entry is valid, free that page
-                    free_kpages(((struct page_table_entry *)(as->page_table[i].index << 12))[j].index << 12);
-            //free 2nd lvl page table
-            free_kpages(as->page_table[i].index << 12);
-        }
-    //free 1st level page table
-    free_kpages((vaddr_t)as->page_table);
+    int i;
+    vaddr_t vaddr;
+    struct page_table_entry *pte;
+    struct pt_iter it;
+
+    //loop thru the pages
+    pt_iter_init(&it, as);
+    while((pte = pt_iter_next(&it, &vaddr)) != NULL) {
+        as_release_page(as, vaddr, pte);
+    }
+    //free the page table itself
+    pt_destroy(as);
+    //let go of the files the segments were paged in from
+    for(i = 0; i < 4; i++) {
+        if(as->segment_table[i].valid && as->segment_table[i].vnode != NULL)
+            VOP_DECREF(as->segment_table[i].vnode);
+    }
+    for(i = 0; i < MMAP_MAX; i++) {
+        if(as->mmap_table[i].valid && as->mmap_table[i].vnode != NULL)
+            VOP_DECREF(as->mmap_table[i].vnode);
+    }
     //free addrspace struct
 	kfree(as);
 }
@@ -165,8 +285,6 @@ as_activate(void)
 {
 	struct addrspace *as;
 
-	vm_tlbshootdown_all();
-
 	as = proc_getas();
 	if (as == NULL) {
 		/*
@@ -175,6 +293,9 @@ as_activate(void)
 		 */
 		return;
 	}
+
+	/* TLB entries are tagged with an ASID, no need to flush them */
+	vm_tlb_activate(as);
 }
 
 void
@@ -248,6 +369,13 @@ void* sbrk__(intptr_t amt, int *err){
         return (void*) -1;   
     }
 
+    // * or with an mmap region
+    if(new_heap_top > old_heap_top && as_range_mapped(as, old_heap_top, new_heap_top)){
+        *err = ENOMEM;
+        release_cm_lock();
+        return (void*) -1;
+    }
+
 
     // everything is okay, set the new heap top
     as->heap_top = new_heap_top;
@@ -319,10 +447,40 @@ as_complete_load(struct addrspace *as)
 {
     //unset ignore permissions bit
 	as->ignore_permissions = 0;
-	vm_tlbshootdown_all();
+	vm_tlbflush_as(as);
 	return 0;
 }
 
+/*
+ * Back the region starting at VADDR with FILESIZE bytes of the file V,
+ * starting at file offset OFFSET. Nothing is read here: vm_fault reads
+ * a page in from the file when it is first touched, and anything in the
+ * region past FILESIZE is zero-filled. The address space keeps its own
+ * reference to V.
+ */
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+                  off_t offset, size_t filesize)
+{
+    unsigned int i;
+    for(i = 0; i < 4; i++) {
+        if(as->segment_table[i].valid && as->segment_table[i].start == vaddr)
+            break;
+    }
+    if(i == 4 || i == SG_STACK)
+        return EINVAL;
+    if(filesize > as->segment_table[i].end - vaddr)
+        return EINVAL;
+
+    VOP_INCREF(v);
+    if(as->segment_table[i].vnode != NULL)
+        VOP_DECREF(as->segment_table[i].vnode);
+    as->segment_table[i].vnode = v;
+    as->segment_table[i].file_offset = offset;
+    as->segment_table[i].file_size = filesize;
+    return 0;
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
@@ -339,3 +497,161 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Set up an mmap region of LEN bytes, paged in from V starting at file
+ * offset OFFSET, or zero-filled if V is NULL. Nothing is read here, and
+ * nothing is mapped yet: vm_fault does that when a page is first used.
+ * The region goes first fit, top down, into the space between the heap
+ * and the stack. Hands back its start address in RET.
+ */
+int
+as_define_mmap(struct addrspace *as, size_t len, int prot, int flags,
+               struct vnode *v, off_t offset, vaddr_t *ret)
+{
+    struct segment_table_entry *region = NULL;
+    vaddr_t top, bottom = 0;
+    bool moved;
+    int i;
+
+    KASSERT(len > 0 && len % PAGE_SIZE == 0);
+
+    for(i = 0; i < MMAP_MAX; i++) {
+        if(!as->mmap_table[i].valid) {
+            region = &as->mmap_table[i];
+            break;
+        }
+    }
+    if(region == NULL)
+        return ENOMEM;
+
+    //the heap grows up from below, the stack down from above
+    for(i = 0; i < SG_STACK; i++) {
+        if(as->segment_table[i].valid && ROUNDUP(as->segment_table[i].end, PAGE_SIZE) > bottom)
+            bottom = ROUNDUP(as->segment_table[i].end, PAGE_SIZE);
+    }
+    top = USERSTACK - MMAP_STACK_GAP;
+    if(as->segment_table[SG_STACK].valid &&
+       as->segment_table[SG_STACK].start < top + 10*PAGE_SIZE)
+        top = (as->segment_table[SG_STACK].start & PAGE_FRAME) - 10*PAGE_SIZE;
+
+    //move down below every region in the way
+    do {
+        if(top < bottom || len > top - bottom)
+            return ENOMEM;
+        moved = false;
+        for(i = 0; i < MMAP_MAX; i++) {
+            if(as->mmap_table[i].valid && as->mmap_table[i].start < top &&
+               as->mmap_table[i].end > top - len) {
+                top = as->mmap_table[i].start;
+                moved = true;
+            }
+        }
+    } while(moved);
+
+    region->start = top - len;
+    region->end = top;
+    region->valid = 1;
+    region->read = (prot & PROT_READ) != 0;
+    region->write = (prot & PROT_WRITE) != 0;
+    region->execute = (prot & PROT_EXEC) != 0;
+    region->index = 0;
+    region->shared = (flags & MAP_SHARED) != 0;
+    region->vnode = v;
+    region->file_offset = offset;
+    //mmap regions are read in whole pages, the end of the file zero-fills
+    region->file_size = 0;
+    if(v != NULL)
+        VOP_INCREF(v);
+
+    *ret = region->start;
+    return 0;
+}
+
+/*
+ * Remove the part of the mmap regions between VADDR and VADDR+LEN. Their
+ * pages there are let go, dirty pages of shared regions are written back
+ * to the file. A region may lose its start or its end, or get split in
+ * two. Whatever else is in the range is not touched.
+ */
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct segment_table_entry *region;
+    struct page_table_entry *pte;
+    vaddr_t end = vaddr + len;
+    vaddr_t va, from, to;
+    int i, spare = -1;
+
+    KASSERT(vaddr % PAGE_SIZE == 0 && len % PAGE_SIZE == 0);
+
+    //splitting a region takes another entry, find it before anything changes
+    for(i = 0; i < MMAP_MAX; i++) {
+        region = &as->mmap_table[i];
+        if(region->valid && region->start < vaddr && region->end > end) {
+            for(spare = 0; spare < MMAP_MAX && as->mmap_table[spare].valid; spare++)
+                ;
+            if(spare == MMAP_MAX)
+                return ENOMEM;
+        }
+    }
+
+    //nothing may keep using the pages through the tlb
+    vm_tlbflush_as(as);
+
+    for(i = 0; i < MMAP_MAX; i++) {
+        region = &as->mmap_table[i];
+        if(!region->valid || region->end <= vaddr || region->start >= end)
+            continue;
+
+        from = region->start > vaddr ? region->start : vaddr;
+        to = region->end < end ? region->end : end;
+        for(va = from; va < to; va += PAGE_SIZE) {
+            pte = pt_lookup(as, va);
+            if(pte != NULL && pte->valid)
+                as_release_page(as, va, pte);
+        }
+
+        if(from == region->start && to == region->end) {
+            if(region->vnode != NULL)
+                VOP_DECREF(region->vnode);
+            region->vnode = NULL;
+            region->valid = 0;
+        } else if(from == region->start) {
+            region->file_offset += to - region->start;
+            region->start = to;
+        } else if(to == region->end) {
+            region->end = from;
+        } else {
+            //the rest after the hole gets its own entry
+            as->mmap_table[spare] = *region;
+            as->mmap_table[spare].file_offset += to - region->start;
+            as->mmap_table[spare].start = to;
+            if(region->vnode != NULL)
+                VOP_INCREF(region->vnode);
+            region->end = from;
+        }
+    }
+    return 0;
+}
+
+struct segment_table_entry *
+as_find_mmap(struct addrspace *as, vaddr_t vaddr)
+{
+    for(int i = 0; i < MMAP_MAX; i++) {
+        if(as->mmap_table[i].valid && vaddr >= as->mmap_table[i].start &&
+           vaddr < as->mmap_table[i].end)
+            return &as->mmap_table[i];
+    }
+    return NULL;
+}
+
+bool
+as_range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    for(int i = 0; i < MMAP_MAX; i++) {
+        if(as->mmap_table[i].valid && as->mmap_table[i].start < end &&
+           as->mmap_table[i].end > start)
+            return true;
+    }
+    return false;
+}
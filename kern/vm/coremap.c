@@ -2,8 +2,14 @@
 #include <types.h>
 #include <lib.h>
 #include <vm.h>
+#include <addrspace.h>
 #include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <pagepolicy.h>
+#include <diskmap.h>
 #include <kern/fcntl.h>
+#include <vmstat.h>
 
 
 // the borders of the ram after ram_bootstrap
@@ -17,10 +23,118 @@ unsigned int number_of_pages_avail = -1;
 // allocate a static spinlock
 static struct spinlock coremap_lock;
 
+// heads of the buddy free lists, one per order. -1 if the list is empty
+static int free_lists[CM_MAX_ORDER + 1];
+
+// pool of pre-zeroed pages, off the buddy lists. the pagezero thread refills it
+// once it drops below the low watermark
+#define ZERO_POOL_SIZE 64
+#define ZERO_POOL_LOW  16
+static unsigned int zero_pool[ZERO_POOL_SIZE];
+static unsigned int zero_pool_count = 0;
+static struct wchan* zero_wchan = NULL;
+
+// number of free pages (on the buddy lists or in the zero pool), the fewest there
+// have been, and the channel the pageout daemon waits on for them to run low
+static unsigned int pages_free = 0;
+static unsigned int pages_free_low = 0;
+static struct wchan* pageout_wchan = NULL;
+
+// allocations that found memory full wait here for pages to be freed, and faults
+// that found their page busy for it to be paged out or cleaned
+static struct wchan* frames_wchan = NULL;
+
+// where the search for dirty pages to clean left off
+static unsigned int clean_hand = 0;
+
+// heads of the page cache hash chains, -1 if the bucket is empty. the chains are
+// linked through the coremap, so the page cache never has to allocate
+#define PC_BUCKETS 64
+static int pc_buckets[PC_BUCKETS];
+
+// removes the free block starting at page_index from the list of its order
+static void free_list_remove(unsigned int page_index){
+    struct cm_entry* e = &coremap[page_index];
+
+    KASSERT(e->order >= 0 && e->order <= CM_MAX_ORDER);
+
+    if(e->prev >= 0)
+        coremap[e->prev].next = e->next;
+    else
+        free_lists[e->order] = e->next;
+    if(e->next >= 0)
+        coremap[e->next].prev = e->prev;
+
+    e->order = -1;
+    e->next = -1;
+    e->prev = -1;
+}
+
+// puts the free block starting at page_index on the list of the given order
+static void free_list_push(unsigned int page_index, int order){
+    struct cm_entry* e = &coremap[page_index];
+
+    e->order = order;
+    e->prev = -1;
+    e->next = free_lists[order];
+    if(e->next >= 0)
+        coremap[e->next].prev = page_index;
+    free_lists[order] = page_index;
+}
+
+// gives a single page back to the buddy lists and merges it with its buddies
+static void free_list_insert(unsigned int page_index){
+    int order = 0;
+
+    while(order < CM_MAX_ORDER){
+        unsigned int buddy = page_index ^ (1 << order);
+
+        // the buddy has to be a free block of the same size to merge
+        if(buddy >= number_of_pages_avail || !coremap[buddy].free || coremap[buddy].order != order)
+            break;
+
+        free_list_remove(buddy);
+        if(buddy < page_index)
+            page_index = buddy;
+        order++;
+    }
+
+    free_list_push(page_index, order);
+}
+
+// takes a block of 2^order pages off the free lists, splitting bigger blocks
+static bool free_list_take(int order, unsigned int* page_index){
+    int o = order;
+
+    // find the smallest order which has a free block
+    while(o <= CM_MAX_ORDER && free_lists[o] < 0)
+        o++;
+    if(o > CM_MAX_ORDER)
+        return false;
+
+    unsigned int index = free_lists[o];
+    free_list_remove(index);
+
+    // split it up and give back the upper halves
+    while(o > order){
+        o--;
+        free_list_push(index + (1 << o), o);
+    }
+
+    *page_index = index;
+    return true;
+}
+
 
 // acquires the coremap lock
 void acquire_cm_lock(void){
+    // only a hint, the holder may be gone by the time we try
+    bool held = spinlock_data_get(&coremap_lock.splk_lock) != 0;
+
     spinlock_acquire(&coremap_lock);
+    vmstat_inc(VMS_CMLOCK);
+    if(held)
+        vmstat_inc(VMS_CMLOCK_CONTENDED);
 }
 
 // releases the coremap lock
@@ -96,13 +210,30 @@ void coremap_bootstrap(void){
     for(unsigned int i = 0; i < number_of_pages_avail; i++){
         coremap[i].free = 1; 
         coremap[i].kernel = 0;
+        coremap[i].as = NULL;
         coremap[i].pte = NULL;
+        coremap[i].refcount = 0;
+        coremap[i].npages = 0;
+        coremap[i].order = -1;
+        coremap[i].next = -1;
+        coremap[i].prev = -1;
+        coremap[i].zeroed = 0;
+        coremap[i].vaddr = 0;
+        coremap[i].referenced = 0;
+        coremap[i].busy = 0;
+        coremap[i].age = 0;
+        coremap[i].swap_slot = -1;
+        coremap[i].pc_vnode = NULL;
+        coremap[i].pc_offset = 0;
+        coremap[i].pc_next = -1;
     }
 
     // lock the pages which are occupied by the coremap
     for(unsigned int i = 0; i < number_of_pages; i++){
         coremap[i].free = 0; 
         coremap[i].kernel = 1;
+        coremap[i].refcount = 1;
+        coremap[i].npages = 1;
 
         #ifdef BOOKKEEPING
         cbk_pages_free--;
@@ -118,7 +249,25 @@ void coremap_bootstrap(void){
     // we do this by incrementing the firstpaddr pointer
     firstpaddr += number_of_pages * PAGE_SIZE;
     number_of_pages_avail -= number_of_pages;
+    pages_free = number_of_pages_avail - number_of_pages;
+    pages_free_low = pages_free;
+
+    for(int b = 0; b < PC_BUCKETS; b++)
+        pc_buckets[b] = -1;
+
+    // build the buddy free lists out of the biggest aligned blocks that fit
+    for(int o = 0; o <= CM_MAX_ORDER; o++)
+        free_lists[o] = -1;
 
+    unsigned int block = number_of_pages;
+    while(block < number_of_pages_avail){
+        int order = CM_MAX_ORDER;
+        while(order > 0 && ((block & ((1 << order) - 1)) != 0 || block + (1 << order) > number_of_pages_avail))
+            order--;
+
+        free_list_push(block, order);
+        block += 1 << order;
+    }
 
     // and done.    
     kprintf("%u pages (%u bytest) occupied for the coremap\n", number_of_pages, coremap_size);   
@@ -132,38 +281,52 @@ void coremap_bootstrap(void){
     
 
     kprintf("coremap selftest passed \n");   
+    kprintf("page replacement policy: %s\n", page_policy_get()->pp_name);
 
 }
 
-// returns a swappable page. a swapable page is every page which is not a kernel page and occupied
+// returns a swappable page picked by the configured replacement policy
 bool get_swappable_page(unsigned int* page_index){
 
-    // get a random page index
-    unsigned int r = random();
+    bool found = page_policy_get()->pp_select(page_index);
+
+    if(found)
+        KASSERT(is_swappable(*page_index));
+    else
+        *page_index = 0;
 
-    unsigned int random_page_index = r % number_of_pages_avail;
-    KASSERT(random_page_index >0 && random_page_index < number_of_pages_avail);
+    return found;
+}
 
-    // find a free page starting at the random_page_index
-    unsigned int counter = 0;
-    bool found_page = false;
+// returns true if the page may be paged out
+bool is_swappable(unsigned int page_index){
+    KASSERT(page_index < number_of_pages_avail);
 
-    while(counter < number_of_pages_avail && !found_page){
+    struct cm_entry* e = &coremap[page_index];
+    return !e->free && !e->kernel && !e->busy && e->refcount == 1 && e->pte != NULL;
+}
 
-        if(coremap[random_page_index].kernel == 0 && coremap[random_page_index].free == 0){
-            found_page = true;
-            break;
-        }
-        counter++;
-        random_page_index++;
-        random_page_index = random_page_index % number_of_pages_avail;
-    }
-    if(found_page)
-        KASSERT(coremap[random_page_index].kernel == 0 && coremap[random_page_index].free == 0);
+// returns a swappable page that is dirty, not in the page cache and was not used since the
+// replacement policy last looked at it, so it is likely to be evicted soon. the search goes
+// round the coremap with its own hand
+bool get_dirty_page(unsigned int* page_index){
+    unsigned int size = get_coremap_size();
+
+    for(unsigned int counter = 0; counter < size; counter++){
+        unsigned int i = clean_hand;
+        clean_hand = (clean_hand + 1) % size;
 
-    *page_index = random_page_index;
+        if(!is_swappable(i) || coremap[i].referenced || coremap[i].pc_vnode != NULL)
+            continue;
+        if(!coremap[i].pte->dirty)
+            continue;
 
-    return found_page;
+        *page_index = i;
+        return true;
+    }
+
+    *page_index = 0;
+    return false;
 }
 
 
@@ -196,37 +359,94 @@ void coremap_selftest(void){
     check = is_kernel_page(free_page_index);
     KASSERT(check == false);
 
+    KASSERT(get_refcount(free_page_index) == 1);
+    inc_refcount(free_page_index);
+    KASSERT(get_refcount(free_page_index) == 2);
+    check = dec_refcount(free_page_index);
+    KASSERT(check == false);
+    check = dec_refcount(free_page_index);
+    KASSERT(check);
+
     set_free(free_page_index);
     check = is_free(free_page_index);
     KASSERT(check);
 
+    // get a contiguous run and give it back, it should merge again
+    KASSERT(get_free_pages(3, &free_page_index));
+    for(unsigned int i = 0; i < 3; i++){
+        KASSERT(is_free(free_page_index + i));
+        set_occupied(free_page_index + i);
+    }
+    for(unsigned int i = 0; i < 3; i++){
+        set_free(free_page_index + i);
+    }
+    unsigned int second_index;
+    KASSERT(get_free_pages(3, &second_index));
+    KASSERT(second_index == free_page_index);
+    for(unsigned int i = 0; i < 3; i++){
+        set_occupied(second_index + i);
+    }
+    for(unsigned int i = 0; i < 3; i++){
+        set_free(second_index + i);
+    }
+
+    // enter pages into the page cache. any address works as the vnode, it is only compared
+    struct vnode* v = (struct vnode*) &coremap[0];
+    KASSERT(get_free_pages(2, &free_page_index));
+    set_occupied(free_page_index);
+    set_occupied(free_page_index + 1);
+    pc_insert(free_page_index, v, 0);
+    pc_insert(free_page_index + 1, v, PAGE_SIZE * PC_BUCKETS);
+    KASSERT(pc_lookup(v, 0, &second_index) && second_index == free_page_index);
+    KASSERT(pc_lookup(v, PAGE_SIZE * PC_BUCKETS, &second_index) && second_index == free_page_index + 1);
+    KASSERT(!pc_lookup(v, PAGE_SIZE, &second_index));
+
+    // freeing a page takes it out of the cache, the other one in its bucket stays
+    set_free(free_page_index);
+    KASSERT(!pc_is_cached(free_page_index));
+    KASSERT(!pc_lookup(v, 0, &second_index));
+    KASSERT(pc_lookup(v, PAGE_SIZE * PC_BUCKETS, &second_index) && second_index == free_page_index + 1);
+    pc_remove(free_page_index + 1);
+    KASSERT(!pc_lookup(v, PAGE_SIZE * PC_BUCKETS, &second_index));
+    set_free(free_page_index + 1);
+
     release_cm_lock();
 
 }
 
 bool get_free_page(unsigned int* page_index){
 
-    for(unsigned int i = 0; i < number_of_pages_avail; i++){
-        if(is_free(i)){
-            *page_index = i;
+    // hand out pre-zeroed pages first
+    if(zero_pool_count > 0){
+        *page_index = zero_pool[--zero_pool_count];
 
-            // get the kvaddr
-            vaddr_t addr = get_page_vaddr(i);
+        if(zero_pool_count < ZERO_POOL_LOW && zero_wchan != NULL)
+            wchan_wakeall(zero_wchan, &coremap_lock);
 
-            uint32_t* page = (uint32_t*) addr;
-            //(void) page;
+        return true;
+    }
 
-            // delete stuff
-            for(unsigned int j = 0; j < PAGE_SIZE / sizeof(uint32_t); j++){
-                page[j] = 0;
-            }
+    return get_free_pages(1, page_index);
+}
 
-            return true;
-        }
+bool get_free_pages(unsigned int npages, unsigned int* page_index){
+    KASSERT(npages > 0);
+
+    // find the order of the smallest block holding npages
+    int order = 0;
+    while((1U << order) < npages)
+        order++;
+
+    if(order > CM_MAX_ORDER || !free_list_take(order, page_index)){
+        *page_index = 0xBADEAFFE;
+        return false;
     }
 
-    *page_index = 0xBADEAFFE;
-    return false;
+    // give back the tail of the block which is not needed
+    for(unsigned int i = npages; i < (1U << order); i++)
+        free_list_insert(*page_index + i);
+
+    return true;
 }
 
 // returns the virtual (kernel) address of the page with the given address
@@ -273,6 +493,14 @@ void set_occupied(unsigned int page_index){
     KASSERT(page_index < number_of_pages_avail);
     
     coremap[page_index].free = false;    
+    coremap[page_index].refcount = 1;
+    pages_free--;
+    if(pages_free < pages_free_low)
+        pages_free_low = pages_free;
+
+    // running low, let the pageout daemon reclaim some pages
+    if(pages_free < PAGEOUT_LOW && pageout_wchan != NULL)
+        wchan_wakeall(pageout_wchan, &coremap_lock);
 
     #ifdef BOOKKEEPING
     cbk_pages_free--;
@@ -287,7 +515,21 @@ void set_free(unsigned int page_index){
     KASSERT(page_index < number_of_pages_avail);
  
     coremap[page_index].free = true;
-
+    coremap[page_index].refcount = 0;
+    coremap[page_index].npages = 0;
+    coremap[page_index].as = NULL;
+    coremap[page_index].pte = NULL;
+    coremap[page_index].vaddr = 0;
+    coremap[page_index].zeroed = 0;
+    coremap[page_index].referenced = 0;
+    coremap[page_index].age = 0;
+    pages_free++;
+
+    // the copy on disk is of no use anymore, and neither is the cached file page
+    release_swap_slot(page_index);
+    pc_remove(page_index);
+
+    #ifdef DEADBEEF_FREED_PAGES
     // get the kvaddr
     vaddr_t addr = get_page_vaddr(page_index);
 
@@ -297,6 +539,14 @@ void set_free(unsigned int page_index){
     for(unsigned int i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++){
         page[i] = 0xDEADBEEF;
     }
+    #endif
+
+    // back on the buddy lists
+    free_list_insert(page_index);
+
+    // somebody may be waiting for just this page
+    if(frames_wchan != NULL)
+        wchan_wakeall(frames_wchan, &coremap_lock);
 
     #ifdef BOOKKEEPING
     cbk_pages_free++;
@@ -328,10 +578,275 @@ void set_user_page(unsigned int page_index){
 }
 
 //sets the lookup of the coremap entry
-void set_lookup(unsigned int page_index, struct page_table_entry * pte) {
+void set_lookup(unsigned int page_index, struct addrspace * as, struct page_table_entry * pte, vaddr_t vaddr) {
     KASSERT(page_index < number_of_pages_avail);
     
+    coremap[page_index].as = as;
     coremap[page_index].pte = pte;
+    coremap[page_index].vaddr = vaddr;
+}
+
+// returns the reverse lookup entry of the page
+struct page_table_entry* get_lookup(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].pte;
+}
+
+// returns the address space the reverse lookup entry belongs to
+struct addrspace* get_lookup_as(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].as;
+}
+
+// returns the user address the page is mapped at
+vaddr_t get_lookup_vaddr(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].vaddr;
+}
+
+// marks the page as recently used. a lost update only costs a second chance,
+// so this does not need the coremap lock
+void set_referenced(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    coremap[page_index].referenced = 1;
+}
+
+// clears the referenced bit of the page. returns its old value
+bool clear_referenced(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    bool referenced = coremap[page_index].referenced;
+    coremap[page_index].referenced = 0;
+    return referenced;
+}
+
+// returns / sets the age of the page for the aging policy
+unsigned int get_age(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].age;
+}
+
+void set_age(unsigned int page_index, unsigned int age) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    coremap[page_index].age = age;
+}
+
+// pins / unpins the page while it is being paged out. unpinning wakes the threads in
+// busy_wait
+void set_busy(unsigned int page_index, bool busy) {
+    KASSERT(page_index < number_of_pages_avail);
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    coremap[page_index].busy = busy;
+    if(!busy && frames_wchan != NULL)
+        wchan_wakeall(frames_wchan, &coremap_lock);
+}
+
+// sleeps until a busy page is unpinned. the caller checks whether it was its own
+void busy_wait(void) {
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(frames_wchan != NULL);
+
+    wchan_sleep(frames_wchan, &coremap_lock);
+}
+
+// returns true if the page is being paged out
+bool get_busy(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].busy;
+}
+
+// returns the disk page holding a copy of the page, -1 if none
+int get_swap_slot(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].swap_slot;
+}
+
+// sets the disk page holding a copy of the page
+void set_swap_slot(unsigned int page_index, int slot) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    coremap[page_index].swap_slot = slot;
+}
+
+// gives the disk page holding a copy of the page back to the diskmap
+void release_swap_slot(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    if(coremap[page_index].swap_slot < 0)
+        return;
+
+    dm_acquire_lock();
+    dm_set_free(coremap[page_index].swap_slot);
+    dm_release_lock();
+    coremap[page_index].swap_slot = -1;
+}
+
+// returns the number of free pages
+unsigned int get_free_page_count(void) {
+    return pages_free;
+}
+
+// returns the fewest free pages there have been since boot
+unsigned int get_free_page_low(void) {
+    return pages_free_low;
+}
+
+// creates the channels of the pageout daemon and of the threads waiting for frames
+void pageout_bootstrap(void) {
+    pageout_wchan = wchan_create("pageout");
+    if(pageout_wchan == NULL)
+        panic("pageout_bootstrap: could not create wchan\n");
+    frames_wchan = wchan_create("frames");
+    if(frames_wchan == NULL)
+        panic("pageout_bootstrap: could not create wchan\n");
+}
+
+// sleeps until the number of free pages drops below PAGEOUT_LOW. always sleeps at
+// least once, so a daemon which could not reclaim anything waits for the next allocation
+void pageout_wait(void) {
+    acquire_cm_lock();
+    do {
+        wchan_sleep(pageout_wchan, &coremap_lock);
+    } while(pages_free >= PAGEOUT_LOW);
+
+    release_cm_lock();
+}
+
+// wakes the pageout daemon and sleeps until a page is freed or paged out, or the
+// daemon finished its pass. returns right away if there are free pages or no daemon yet
+void pageout_reclaim_wait(void) {
+    acquire_cm_lock();
+    if(pages_free == 0 && frames_wchan != NULL){
+        wchan_wakeall(pageout_wchan, &coremap_lock);
+        wchan_sleep(frames_wchan, &coremap_lock);
+    }
+    release_cm_lock();
+}
+
+// wakes the threads in pageout_reclaim_wait. the pageout daemon calls this after
+// every pass, whether it got any pages back or not
+void pageout_done(void) {
+    acquire_cm_lock();
+    if(frames_wchan != NULL)
+        wchan_wakeall(frames_wchan, &coremap_lock);
+    release_cm_lock();
+}
+
+// returns the number of pages whose reverse lookup points into as. frames shared
+// copy-on-write that point elsewhere or nowhere are not counted
+unsigned int get_resident_count(struct addrspace* as) {
+    unsigned int n = 0;
+
+    acquire_cm_lock();
+    for(unsigned int i = 0; i < number_of_pages_avail; i++){
+        if(!coremap[i].free && !coremap[i].kernel && coremap[i].as == as)
+            n++;
+    }
+    release_cm_lock();
+    return n;
+}
+
+// returns the number of references held on the page
+unsigned int get_refcount(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].refcount;
+}
+
+// adds a reference to the page. used to share a page copy-on-write
+void inc_refcount(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+    KASSERT(coremap[page_index].free == false);
+
+    coremap[page_index].refcount++;
+}
+
+// drops a reference to the page. returns true if it was the last one
+bool dec_refcount(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+    KASSERT(coremap[page_index].refcount > 0);
+
+    coremap[page_index].refcount--;
+    return coremap[page_index].refcount == 0;
+}
+
+// clears the zeroed flag of the page. returns true if the page was pre-zeroed
+bool clear_zeroed(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    bool zeroed = coremap[page_index].zeroed;
+    coremap[page_index].zeroed = 0;
+    return zeroed;
+}
+
+// background thread zeroing free pages into the zero pool. it yields after
+// every page so it only really runs when nobody else wants the cpu
+static int pagezero_thread(void* data1, unsigned long data2){
+    (void) data1;
+    (void) data2;
+
+    unsigned int page_index;
+
+    // zeroing pages ahead is only worth the cpu nobody else wants
+    thread_set_background();
+
+    while(true){
+        acquire_cm_lock();
+
+        // sleep while the pool is full or there is nothing left to zero.
+        // get_free_page wakes us up once the pool runs low
+        while(zero_pool_count >= ZERO_POOL_SIZE || !get_free_pages(1, &page_index))
+            wchan_sleep(zero_wchan, &coremap_lock);
+
+        release_cm_lock();
+
+        // the page is off the free lists, so we can zero it without the lock
+        bzero((void*) get_page_vaddr(page_index), PAGE_SIZE);
+
+        acquire_cm_lock();
+        coremap[page_index].zeroed = 1;
+        zero_pool[zero_pool_count++] = page_index;
+        release_cm_lock();
+
+        thread_yield();
+    }
+
+    return 0;
+}
+
+// starts the pagezero thread which keeps a pool of pre-zeroed pages
+void pagezero_bootstrap(void){
+
+    zero_wchan = wchan_create("pagezero");
+    if(zero_wchan == NULL)
+        panic("pagezero_bootstrap: could not create wchan\n");
+
+    int result = thread_fork("pagezero", NULL, NULL, pagezero_thread, NULL, 0);
+    if(result)
+        panic("pagezero_bootstrap: thread_fork failed: %s\n", strerror(result));
+}
+
+// sets the number of pages of the allocation starting at the page
+void set_run_length(unsigned int page_index, unsigned int npages) {
+    KASSERT(page_index + npages <= number_of_pages_avail);
+
+    coremap[page_index].npages = npages;
+}
+
+// returns the number of pages of the allocation starting at the page
+unsigned int get_run_length(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].npages;
 }
 
 // returns the number of pages available
@@ -339,4 +854,68 @@ unsigned int get_coremap_size(void) {
     return number_of_pages_avail;
 }
 
+// returns the page cache bucket of the page at offset of v
+static unsigned int pc_hash(struct vnode* v, off_t offset) {
+    return (((uintptr_t)v >> 4) ^ (unsigned int)(offset >> 12)) % PC_BUCKETS;
+}
 
+// looks up the page caching the page at offset of v. returns false if there is none
+bool pc_lookup(struct vnode* v, off_t offset, unsigned int* page_index) {
+    int i;
+
+    for(i = pc_buckets[pc_hash(v, offset)]; i >= 0; i = coremap[i].pc_next) {
+        if(coremap[i].pc_vnode == v && coremap[i].pc_offset == offset) {
+            *page_index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// enters the page into the page cache as the page at offset of v
+void pc_insert(unsigned int page_index, struct vnode* v, off_t offset) {
+    KASSERT(page_index < number_of_pages_avail);
+    KASSERT(coremap[page_index].pc_vnode == NULL);
+    KASSERT(v != NULL);
+
+    unsigned int b = pc_hash(v, offset);
+    coremap[page_index].pc_vnode = v;
+    coremap[page_index].pc_offset = offset;
+    coremap[page_index].pc_next = pc_buckets[b];
+    pc_buckets[b] = page_index;
+}
+
+// takes the page out of the page cache, if it is in it
+void pc_remove(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    if(coremap[page_index].pc_vnode == NULL)
+        return;
+
+    int* link = &pc_buckets[pc_hash(coremap[page_index].pc_vnode, coremap[page_index].pc_offset)];
+    while(*link != (int)page_index) {
+        KASSERT(*link >= 0);
+        link = &coremap[*link].pc_next;
+    }
+    *link = coremap[page_index].pc_next;
+
+    coremap[page_index].pc_vnode = NULL;
+    coremap[page_index].pc_offset = 0;
+    coremap[page_index].pc_next = -1;
+}
+
+// returns true if the page is in the page cache
+bool pc_is_cached(unsigned int page_index) {
+    KASSERT(page_index < number_of_pages_avail);
+
+    return coremap[page_index].pc_vnode != NULL;
+}
+
+// returns the file and the offset in it the page caches. the page has to be cached
+void pc_get_key(unsigned int page_index, struct vnode** v, off_t* offset) {
+    KASSERT(page_index < number_of_pages_avail);
+    KASSERT(coremap[page_index].pc_vnode != NULL);
+
+    *v = coremap[page_index].pc_vnode;
+    *offset = coremap[page_index].pc_offset;
+}
@@ -8,16 +8,40 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <uio.h>
+#include <stat.h>
 #include <kern/fcntl.h>
 #include <kern/errno.h>
+#include <vmstat.h>
 
 
 // allocate a static spinlock
 static struct spinlock diskmap_lock;
 
-struct bitmap* diskmap;
-
-struct vnode* swap_disk;
+// disk page numbers have to fit the index of a page table entry
+#define DM_MAX_PAGES    (1u << 24)
+
+/*
+ * A swap device. Disk pages are numbered across all devices: the pages
+ * of a device are sd_base .. sd_base + sd_npages - 1, and each device
+ * keeps its own bitmap of them. A device is only taken out of use when
+ * none of its pages are occupied, so no page table entry can still
+ * point at its numbers and they may go to the next device added.
+ */
+struct swap_dev {
+    char sd_name[SWAP_NAME_LEN];        // device name, e.g. lhd0raw:
+    struct vnode* sd_vnode;             // NULL if the entry is unused
+    struct bitmap* sd_map;              // occupied disk pages of the device
+    unsigned int sd_base;               // number of the first disk page of the device
+    unsigned int sd_npages;             // disk pages on the device
+    unsigned int sd_inuse;              // occupied disk pages
+    unsigned int sd_hint;               // next-fit hint: where the last search left off
+    int sd_prio;                        // devices of higher priority are used first
+};
+
+static struct swap_dev swap_devs[SWAP_MAX_DEVS];
+
+// the device of the highest priority the next new cluster tries first
+static unsigned int dm_stripe;
 
 
 // acquires the diskmap lock
@@ -30,11 +54,23 @@ void dm_release_lock(void){
     spinlock_release(&diskmap_lock);
 }
 
+// returns the device disk page page_index is on, NULL if there is none
+static struct swap_dev* dm_dev(unsigned int page_index){
+    for(unsigned int i = 0; i < SWAP_MAX_DEVS; i++){
+        struct swap_dev* d = &swap_devs[i];
+        if(d->sd_vnode != NULL && page_index - d->sd_base < d->sd_npages){
+            return d;
+        }
+    }
+    return NULL;
+}
+
 // returns true if the page on disk is not occupied, false otherwise
-bool dm_is_free(unsigned int page_index){ 
-    KASSERT(page_index < diskmap->nbits);
+bool dm_is_free(unsigned int page_index){
+    struct swap_dev* d = dm_dev(page_index);
+    KASSERT(d != NULL);
 
-    int ret = bitmap_isset(diskmap, page_index);
+    int ret = bitmap_isset(d->sd_map, page_index - d->sd_base);
     return ret == 0? true : false;
 }
 
@@ -42,148 +78,595 @@ bool dm_is_free(unsigned int page_index){
 
 // sets the specified page to free
 void dm_set_free(unsigned int page_index) {
-    KASSERT(page_index < diskmap->nbits);
+    struct swap_dev* d = dm_dev(page_index);
+    KASSERT(d != NULL);
 
 
-    if(is_free(page_index)) {
+    if(dm_is_free(page_index)) {
         // page is already free. // TDOD: is this an error?
         // KASSERT(false);
     }
 
-    bitmap_unmark(diskmap, page_index);
+    bitmap_unmark(d->sd_map, page_index - d->sd_base);
+    d->sd_inuse--;
 }
 
 
 // sets the specified page to occupied
-void dm_set_occupied(unsigned int page_index){ 
-    KASSERT(page_index < diskmap->nbits);
-    
-    if(!is_free(page_index)) {
+void dm_set_occupied(unsigned int page_index){
+    struct swap_dev* d = dm_dev(page_index);
+    KASSERT(d != NULL);
+
+    if(!dm_is_free(page_index)) {
         // page is already in use
         KASSERT(false);
     }
 
-    bitmap_mark(diskmap, page_index);
+    bitmap_mark(d->sd_map, page_index - d->sd_base);
+    d->sd_inuse++;
 }
 
 
-// get the index of a free page. page will be marked as occupied. returns false if disk full
-bool dm_get_free_page(unsigned int* page_index){
-    KASSERT(page_index != NULL);
+/*
+ * The bits are searched 32 at a time, so a full stretch of the disk
+ * costs one compare per 32 pages. The bitmap stores its bits bytewise,
+ * which makes a word all ones or all zeros independent of endianness;
+ * mixed words are then looked at bit by bit. The searches work on the
+ * page numbers of one device, starting at 0.
+ */
+#define DM_WORD_BITS    32
+#define DM_WORD_FULL    0xffffffff
+
+// disk pages set aside for a page and the virtual pages following it
+#define DM_CLUSTER      8
 
-    for(unsigned int i = 0; i < diskmap->nbits; i++){
-        if(is_free(i)){
-            *page_index = i;
+static inline uint32_t dm_word(struct swap_dev* d, unsigned int bit){
+    return ((uint32_t *)d->sd_map->v)[bit / DM_WORD_BITS];
+}
 
-            dm_set_occupied(i);
+static inline bool dm_bit_free(struct swap_dev* d, unsigned int bit){
+    return bitmap_isset(d->sd_map, bit) == 0;
+}
 
-            return true;
+// finds npages free pages in a row in [start, end). does not mark them
+static bool dm_find_run(struct swap_dev* d, unsigned int start, unsigned int end, unsigned int npages, unsigned int* first){
+    unsigned int run = 0;
+    unsigned int i = start;
+
+    while(i < end){
+        if(i % DM_WORD_BITS == 0 && i + DM_WORD_BITS <= end){
+            uint32_t w = dm_word(d, i);
+            if(w == DM_WORD_FULL){
+                run = 0;
+                i += DM_WORD_BITS;
+                continue;
+            }
+            if(w == 0){
+                if(run + DM_WORD_BITS >= npages){
+                    *first = i - run;
+                    return true;
+                }
+                run += DM_WORD_BITS;
+                i += DM_WORD_BITS;
+                continue;
+            }
         }
-    }
 
-    *page_index = 0;
+        if(dm_bit_free(d, i)){
+            run++;
+            if(run == npages){
+                *first = i + 1 - npages;
+                return true;
+            }
+        } else {
+            run = 0;
+        }
+        i++;
+    }
     return false;
 }
 
+// searches from the hint to the end of the device, then wraps around
+static bool dm_find_run_from_hint(struct swap_dev* d, unsigned int npages, unsigned int* first){
+    unsigned int start = d->sd_hint - d->sd_hint % DM_WORD_BITS;
+    unsigned int wrap_end;
 
+    if(dm_find_run(d, start, d->sd_npages, npages, first)){
+        return true;
+    }
 
+    // a run may straddle the hint, so overlap the two searches
+    wrap_end = start + npages - 1;
+    if(wrap_end > d->sd_npages){
+        wrap_end = d->sd_npages;
+    }
+    return dm_find_run(d, 0, wrap_end, npages, first);
+}
+
+/*
+ * Finds npages free pages in a row on one device, trying the devices
+ * from the highest priority down. Devices of the same priority take
+ * turns at being searched first, so consecutive runs are striped over
+ * them and their disks can work at the same time. Does not mark the
+ * pages. returns the device and the first page on it, NULL if no device
+ * has such a run
+ */
+static struct swap_dev* dm_find_stripe(unsigned int npages, unsigned int* first){
+    bool tried = false;
+    int prio = 0;
+
+    while(true){
+        // the highest priority below the one just tried
+        bool found = false;
+        int next = 0;
+        for(unsigned int i = 0; i < SWAP_MAX_DEVS; i++){
+            struct swap_dev* d = &swap_devs[i];
+            if(d->sd_vnode == NULL || (tried && d->sd_prio >= prio)){
+                continue;
+            }
+            if(!found || d->sd_prio > next){
+                next = d->sd_prio;
+                found = true;
+            }
+        }
+        if(!found){
+            return NULL;
+        }
+        prio = next;
+        tried = true;
+
+        for(unsigned int i = 0; i < SWAP_MAX_DEVS; i++){
+            unsigned int n = (dm_stripe + i) % SWAP_MAX_DEVS;
+            struct swap_dev* d = &swap_devs[n];
+            if(d->sd_vnode == NULL || d->sd_prio != prio){
+                continue;
+            }
+            if(dm_find_run_from_hint(d, npages, first)){
+                dm_stripe = (n + 1) % SWAP_MAX_DEVS;
+                return d;
+            }
+        }
+    }
+}
+
+// get npages contiguous free pages. they will be marked as occupied. returns false if there is no such run
+bool dm_get_free_pages(unsigned int npages, unsigned int* first){
+    KASSERT(first != NULL);
+    KASSERT(npages > 0);
+
+    unsigned int local;
+    struct swap_dev* d = dm_find_stripe(npages, &local);
+    if(d == NULL){
+        // no swap, or none with room
+        *first = 0;
+        return false;
+    }
+
+    *first = d->sd_base + local;
+    for(unsigned int i = 0; i < npages; i++){
+        dm_set_occupied(*first + i);
+    }
+
+    d->sd_hint = local + npages;
+    if(d->sd_hint >= d->sd_npages){
+        d->sd_hint = 0;
+    }
+    return true;
+}
+
+// get the index of a free page. page will be marked as occupied. returns false if disk full
+bool dm_get_free_page(unsigned int* page_index){
+    return dm_get_free_pages(1, page_index);
+}
+
+/*
+ * Get npages free pages in a row for pages whose virtual neighbour lives
+ * on disk page near (or -1 if they have none). If the run starting at
+ * near is free it is taken, so neighbouring virtual pages end up next to
+ * each other on disk. Pages without a neighbour on disk start a new
+ * cluster and leave the rest of DM_CLUSTER pages free for their
+ * neighbours to follow. New clusters go round the devices of the highest
+ * priority. Without room for a whole cluster any free run will do.
+ */
+bool dm_get_free_pages_near(int near, unsigned int npages, unsigned int* first){
+    KASSERT(first != NULL);
+    KASSERT(npages > 0);
+
+    struct swap_dev* d = near >= 0 ? dm_dev(near) : NULL;
+    if(d != NULL && near + npages - d->sd_base <= d->sd_npages){
+        bool run_free = true;
+        for(unsigned int i = 0; i < npages; i++){
+            if(!dm_is_free(near + i)){
+                run_free = false;
+                break;
+            }
+        }
+        if(run_free){
+            for(unsigned int i = 0; i < npages; i++){
+                dm_set_occupied(near + i);
+            }
+            *first = near;
+            return true;
+        }
+    }
+
+    unsigned int cluster = npages > DM_CLUSTER ? npages : DM_CLUSTER;
+    unsigned int local;
+    d = dm_find_stripe(cluster, &local);
+    if(d != NULL){
+        *first = d->sd_base + local;
+        for(unsigned int i = 0; i < npages; i++){
+            dm_set_occupied(*first + i);
+        }
+        d->sd_hint = local + cluster;
+        if(d->sd_hint >= d->sd_npages){
+            d->sd_hint = 0;
+        }
+        return true;
+    }
+
+    return dm_get_free_pages(npages, first);
+}
+
+// get a free page, preferably page near (-1 for none). see dm_get_free_pages_near
+bool dm_get_free_page_near(int near, unsigned int* page_index){
+    KASSERT(page_index != NULL);
+
+    return dm_get_free_pages_near(near, 1, page_index);
+}
 
-// sets up the space in virtual memory to hold the diskmap 
-// !!! We call alloc_kpages several times to get contiguous memory.
-// !!! Since bootstrap is called directly after the coremap bootstrap we assume we get contiguous memory
-void diskmap_bootstrap(void){
 
-    // get the number of available pages
-    unsigned int number_of_pages_avail = get_coremap_size();
 
-    // number of available pages upscaled
-    unsigned int number_of_disk_pages = number_of_pages_avail * 16;
 
-    // calculate number of pages needed to store the diskmap (bits and bitmap struct)
-    unsigned int number_of_pages = DIVROUNDUP(DIVROUNDUP(number_of_disk_pages, 8) + (unsigned int)sizeof(struct bitmap), PAGE_SIZE); 
+// sets up the diskmap. the swap devices are added once the devices are probed
+void diskmap_bootstrap(void){
 
-    // 512 MB memory max
+    // 512 MB of swap on one device
     // 4096 Byte a page
     // -> 131072 pages
-    // pages needed for swapping = bits needed for diskmap
-    // 131072 pages * 16 = 2097152 bits
-    //                   = 262144 Byte
-    //                   = 256 k Byte
-    //                                  -> 64 pages max
-
-    // we assume that we can allocate gontiguous pages since we call this function right after coremap_bootstrap()
-    // allocate at least one page for the bitmap
-    diskmap = (struct bitmap*) alloc_kpages(1);
-    diskmap->v = (WORD_TYPE *)(diskmap + sizeof(struct bitmap));
-    KASSERT(diskmap != NULL);
-    for(unsigned int i = 1; i < number_of_pages; i++) {
-        vaddr_t ret = alloc_kpages(1);
-        KASSERT(ret != (vaddr_t)NULL);
-    }
-    
-    (void) number_of_pages;
+    //    = bits needed for its bitmap
+    //    = 16 k Byte
+    //                                  -> 4 pages
+
+    // intialize the spinlock
+    spinlock_init(&diskmap_lock);
+}
+
+/*
+ * Adds the device as swap. It is sized from the device itself, every
+ * whole page of it is used. The new device takes the lowest page numbers
+ * no device in use has, so the numbers of a device taken out of use are
+ * given out again.
+ */
+int swap_on(const char* name, int prio){
+    char path[SWAP_NAME_LEN];
+    struct vnode* vn;
+    struct stat st;
+    struct bitmap* map;
+    struct swap_dev* d;
+    unsigned int npages, nwords, mappages, base;
+    bool moved;
+    int res;
+
+    if(strlen(name) >= SWAP_NAME_LEN){
+        return ENAMETOOLONG;
+    }
+    strcpy(path, name);
+
+    // try to open the vnode
+    res = vfs_open(path, O_RDWR, 0, &vn); //VFS open _will_ mangle with the filename char
+    if(res){
+        return res;
+    }
+
+    // the size of a raw disk is d_blocks * d_blocksize
+    res = VOP_STAT(vn, &st);
+    if(res){
+        vfs_close(vn);
+        return res;
+    }
+    if(st.st_size / PAGE_SIZE > DM_MAX_PAGES){
+        npages = DM_MAX_PAGES;
+    } else {
+        npages = st.st_size / PAGE_SIZE;
+    }
+    if(npages == 0){
+        // not a disk, or smaller than a page
+        vfs_close(vn);
+        return EINVAL;
+    }
+
+    // allocate the bitmap struct and its bits in one contiguous run of pages.
+    // the bits are rounded up to whole 32 bit words for the word-at-a-time search
+    nwords = DIVROUNDUP(npages, DM_WORD_BITS);
+    mappages = DIVROUNDUP(nwords * 4 + (unsigned int)sizeof(struct bitmap), PAGE_SIZE);
+    map = (struct bitmap*) alloc_kpages(mappages);
+    if(map == NULL){
+        vfs_close(vn);
+        return ENOMEM;
+    }
+    map->v = (WORD_TYPE *)(map + 1);
+    KASSERT(((vaddr_t)map->v & 3) == 0);
 
     // create bitmap
-    bitmap_create_diskmap(diskmap, number_of_disk_pages);
+    bitmap_create_diskmap(map, npages);
 
-    // do selftest
-    diskmap_selftest();
+    // bytes past the end of the bitmap round out the last word, mark them in use
+    for(unsigned int i = DIVROUNDUP(npages, BITS_PER_WORD); i < nwords * 4; i++){
+        map->v[i] = WORD_ALLBITS;
+    }
 
-    // finally intialize the spinlock
-    spinlock_init(&diskmap_lock);
+    dm_acquire_lock();
+
+    d = NULL;
+    for(unsigned int i = 0; i < SWAP_MAX_DEVS; i++){
+        if(swap_devs[i].sd_vnode == vn){
+            res = EBUSY;
+            break;
+        }
+        if(swap_devs[i].sd_vnode == NULL && d == NULL){
+            d = &swap_devs[i];
+        }
+    }
+    if(res == 0 && d == NULL){
+        // no room for another device
+        res = ENOSPC;
+    }
+
+    // the lowest numbers that don't overlap a device in use
+    base = 0;
+    moved = true;
+    while(res == 0 && moved){
+        moved = false;
+        for(unsigned int i = 0; i < SWAP_MAX_DEVS; i++){
+            struct swap_dev* o = &swap_devs[i];
+            if(o->sd_vnode != NULL && base < o->sd_base + o->sd_npages && o->sd_base < base + npages){
+                base = o->sd_base + o->sd_npages;
+                moved = true;
+            }
+        }
+    }
+    if(res == 0 && base > DM_MAX_PAGES - npages){
+        res = ENOSPC;
+    }
+
+    if(res){
+        dm_release_lock();
+        free_kpages((vaddr_t)map);
+        vfs_close(vn);
+        return res;
+    }
+
+    strcpy(d->sd_name, name);
+    d->sd_map = map;
+    d->sd_base = base;
+    d->sd_npages = npages;
+    d->sd_inuse = 0;
+    d->sd_hint = 0;
+    d->sd_prio = prio;
+    d->sd_vnode = vn;
+
+    dm_release_lock();
+
+    return 0;
+}
+
+// takes the device out of use. fails with EBUSY while pages are swapped out to it
+int swap_off(const char* name){
+    struct swap_dev* d = NULL;
+    struct vnode* vn;
+    struct bitmap* map;
+
+    dm_acquire_lock();
+
+    for(unsigned int i = 0; i < SWAP_MAX_DEVS; i++){
+        if(swap_devs[i].sd_vnode != NULL && strcmp(swap_devs[i].sd_name, name) == 0){
+            d = &swap_devs[i];
+            break;
+        }
+    }
+    if(d == NULL){
+        dm_release_lock();
+        return ENODEV;
+    }
+    if(d->sd_inuse > 0){
+        dm_release_lock();
+        return EBUSY;
+    }
+
+    vn = d->sd_vnode;
+    map = d->sd_map;
+    d->sd_vnode = NULL;
+    d->sd_map = NULL;
+
+    dm_release_lock();
+
+    free_kpages((vaddr_t)map);
+    vfs_close(vn);
+    return 0;
+}
+
+// prints the swap devices in use
+void swap_print(void){
+    struct swap_dev devs[SWAP_MAX_DEVS];
+
+    // copy them out, kprintf may sleep
+    dm_acquire_lock();
+    memcpy(devs, swap_devs, sizeof(devs));
+    dm_release_lock();
+
+    for(unsigned int i = 0; i < SWAP_MAX_DEVS; i++){
+        struct swap_dev* d = &devs[i];
+        if(d->sd_vnode == NULL){
+            continue;
+        }
+        kprintf("%-10s priority %d, pages %u-%u (%u KB), %u in use\n",
+                d->sd_name, d->sd_prio, d->sd_base, d->sd_base + d->sd_npages - 1,
+                d->sd_npages * (PAGE_SIZE / 1024), d->sd_inuse);
+    }
 }
 
 int swap_bootstrap(){
     char filename[] = "lhd0raw:";
 
-    // try to open the vnode
-    int res = vfs_open(filename, O_RDWR, 0, &swap_disk); //VFS open _will_ mangle with the filename char
-    
-    KASSERT(res == 0);
-    return res;
-    
+    // more devices can be added with swapon from the menu
+    int res = swap_on(filename, 0);
+    if(res){
+        kprintf("swap: %s %s, running without swap\n", filename, strerror(res));
+        return res;
+    }
 
+    // do selftest
+    diskmap_selftest();
+    return 0;
 }
 
-//reads a page out from disk onto physical memory
-int read_page(unsigned int page_index, vaddr_t kpage_addr) {
-    struct iovec iov;
+/*
+ * Transfers npages consecutive disk pages starting at page_index, which
+ * all have to be on one device, in one go. each page goes from / to its
+ * own physical page
+ */
+static int dm_io(unsigned int page_index, const vaddr_t * kpage_addrs, unsigned int npages, enum uio_rw rw) {
+    struct iovec iov[DM_MAX_CLUSTER_IO];
     struct uio io;
-    uio_kinit(&iov,&io,(void*)kpage_addr,PAGE_SIZE,((off_t)page_index) << 12, UIO_READ);
-    int res = VOP_READ(swap_disk, &io);
-    dm_set_free(page_index);
+    struct swap_dev* d;
+    struct vnode* vn;
+    unsigned int base;
+    int res;
+
+    KASSERT(npages > 0 && npages <= DM_MAX_CLUSTER_IO);
+
+    // the device can't go away, its pages are occupied
+    dm_acquire_lock();
+    d = dm_dev(page_index);
+    KASSERT(d != NULL);
+    KASSERT(page_index + npages - d->sd_base <= d->sd_npages);
+    vn = d->sd_vnode;
+    base = d->sd_base;
+    dm_release_lock();
+
+    for(unsigned int i = 0; i < npages; i++) {
+        iov[i].iov_kbase = (void*)kpage_addrs[i];
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    io.uio_iov = iov;
+    io.uio_iovcnt = npages;
+    io.uio_offset = ((off_t)(page_index - base)) << 12;
+    io.uio_resid = npages * PAGE_SIZE;
+    io.uio_segflg = UIO_SYSSPACE;
+    io.uio_rw = rw;
+    io.uio_space = NULL;
+
+    if(rw == UIO_READ) {
+        res = VOP_READ(vn, &io);
+    } else {
+        res = VOP_WRITE(vn, &io);
+    }
+    if(res == 0 && io.uio_resid != 0) {
+        //ran off the end of the disk
+        res = EIO;
+    }
+    return res;
+}
+
+//reads a page out from disk onto physical memory. the page stays occupied on disk,
+//so a clean page can later be dropped without writing it again
+int read_page(unsigned int page_index, vaddr_t kpage_addr) {
+    return read_pages(page_index, &kpage_addr, 1);
+}
+
+//reads npages consecutive pages starting at page_index from disk, in one transfer
+//per device they are on. each page goes to its own physical page, the kpage_addrs
+//don't have to be contiguous
+int read_pages(unsigned int page_index, const vaddr_t * kpage_addrs, unsigned int npages) {
+    unsigned int done = 0;
+
+    while(done < npages) {
+        // the part of the run on the device of its first page
+        dm_acquire_lock();
+        struct swap_dev* d = dm_dev(page_index + done);
+        KASSERT(d != NULL);
+        unsigned int n = d->sd_base + d->sd_npages - (page_index + done);
+        dm_release_lock();
+        if(n > npages - done) {
+            n = npages - done;
+        }
+
+        int res = dm_io(page_index + done, &kpage_addrs[done], n, UIO_READ);
+        if(res) {
+            return res;
+        }
+        done += n;
+    }
+    vmstat_add(VMS_SWAP_READ, npages);
+    return 0;
+}
+
+//writes a page from physical memory out to the given, already occupied disk page
+int write_page_at(unsigned int page_index, vaddr_t kpage_addr) {
+    int res = dm_io(page_index, &kpage_addr, 1, UIO_WRITE);
+    if(res == 0)
+        vmstat_inc(VMS_SWAP_WRITE);
     return res;
 }
 
-//writes a page from physical memory out to disk, returns the disk page index
-int write_page(vaddr_t kpage_addr, unsigned int * ret) {
+//writes a page from physical memory out to disk, returns the disk page index.
+//near is the disk page the page should preferably go to, or -1
+int write_page(vaddr_t kpage_addr, int near, unsigned int * ret) {
+    return write_pages(&kpage_addr, 1, near, ret);
+}
+
+//writes npages physical pages out to npages consecutive free disk pages, in one
+//transfer, and returns the first disk page index. near is the disk page the run
+//should preferably start at, or -1. the kpage_addrs don't have to be contiguous
+int write_pages(const vaddr_t * kpage_addrs, unsigned int npages, int near, unsigned int * ret) {
     dm_acquire_lock();
-    
+
     unsigned int page_index = 0xFFFFFFFF;
-    if(!dm_get_free_page(&page_index))
+    if(!dm_get_free_pages_near(near, npages, &page_index)) {
+        // swap full, or running without swap
+        dm_release_lock();
         return ENOMEM;
+    }
 
     dm_release_lock();
 
-    struct iovec iov;
-    struct uio io;
-    uio_kinit(&iov,&io,(void*)kpage_addr,PAGE_SIZE,((off_t)page_index) << 12, UIO_WRITE);
-    int res = VOP_WRITE(swap_disk, &io);
+    // the run is on one device, so this is one transfer
+    int res = dm_io(page_index, kpage_addrs, npages, UIO_WRITE);
+    if(res) {
+        // nothing usable got written, give the disk pages back
+        dm_acquire_lock();
+        for(unsigned int i = 0; i < npages; i++) {
+            dm_set_free(page_index + i);
+        }
+        dm_release_lock();
+        return res;
+    }
+    vmstat_add(VMS_SWAP_WRITE, npages);
     *ret = page_index;
-    return res;
+    return 0;
 }
 
 
 
 
-// performs a selftest on the diskmap
+// performs a selftest on the diskmap. has to run while the boot swap device is the
+// only one and still empty
 void diskmap_selftest(void){
 
     dm_acquire_lock();
 
-    KASSERT(diskmap != NULL);
-    KASSERT(diskmap->nbits > 0);
-    KASSERT(diskmap->v != NULL);
+    struct swap_dev* d = dm_dev(0);
+    KASSERT(d != NULL);
+    KASSERT(d->sd_map != NULL);
+    KASSERT(d->sd_map->v != NULL);
+    KASSERT(d->sd_inuse == 0);
+
+    if(d->sd_npages < 4 * DM_WORD_BITS){
+        // too small for the test
+        dm_release_lock();
+        return;
+    }
 
     // check the first bits; have to be free
     KASSERT(dm_is_free(0));
@@ -195,6 +678,7 @@ void diskmap_selftest(void){
     KASSERT(dm_is_free(bit));
     dm_set_occupied(bit);
     KASSERT(!dm_is_free(bit));
+    KASSERT(d->sd_inuse == 1);
     dm_set_free(bit);
     KASSERT(dm_is_free(bit));
 
@@ -204,6 +688,54 @@ void diskmap_selftest(void){
     dm_set_free(bit);
     KASSERT(dm_is_free(bit));
 
+    // check get a cluster of free bits, across a word boundary
+    unsigned int first;
+    dm_set_occupied(0);
+    KASSERT(dm_get_free_pages(DM_WORD_BITS + 3, &first));
+    KASSERT(first == 1);
+    for(unsigned int i = 0; i < DM_WORD_BITS + 3; i++){
+        KASSERT(!dm_is_free(first + i));
+    }
+    KASSERT(dm_is_free(first + DM_WORD_BITS + 3));
+
+    // check the next-fit hint moved past the cluster
+    KASSERT(dm_get_free_page(&bit));
+    KASSERT(bit == first + DM_WORD_BITS + 3);
+    dm_set_free(bit);
+
+    // check the search skips holes too small for the cluster
+    dm_set_free(first + 2);
+    dm_set_free(first + 3);
+    d->sd_hint = 0;
+    unsigned int second;
+    KASSERT(dm_get_free_pages(3, &second));
+    KASSERT(second == first + DM_WORD_BITS + 3);
+    for(unsigned int i = 0; i < 3; i++){
+        dm_set_free(second + i);
+    }
+
+    // check placement next to a neighbour
+    KASSERT(dm_get_free_page_near(first + 2, &bit));
+    KASSERT(bit == first + 2);
+    KASSERT(dm_get_free_page_near(first + 4, &bit));
+    KASSERT(bit != first + 4 && !dm_is_free(bit));
+    dm_set_free(bit);
+
+    // check a neighbour past the last device gets a new cluster
+    KASSERT(dm_get_free_page_near(d->sd_npages, &bit));
+    KASSERT(bit < d->sd_npages && !dm_is_free(bit));
+    dm_set_free(bit);
+
+    dm_set_free(0);
+    for(unsigned int i = 0; i < DM_WORD_BITS + 3; i++){
+        if(i != 2 && i != 3){
+            dm_set_free(first + i);
+        }
+    }
+    dm_set_free(first + 2);
+    KASSERT(d->sd_inuse == 0);
+    d->sd_hint = 0;
+    dm_stripe = 0;
+
     dm_release_lock();
 }
-
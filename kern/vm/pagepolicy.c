@@ -0,0 +1,127 @@
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagepolicy.h>
+#include "opt-pagerandom.h"
+#include "opt-pageaging.h"
+
+
+// the hand shared by the clock and the aging policy
+static unsigned int clock_hand = 0;
+
+// tests and clears the referenced bit of the page. if it was set, this cpu's tlb
+// entries for the page are dropped as well, so the next use faults and sets it again
+static bool page_referenced(unsigned int page_index){
+
+    if(!clear_referenced(page_index))
+        return false;
+
+    struct tlbshootdown ts;
+    ts.ts_as = get_lookup_as(page_index);
+    ts.ts_vaddr = get_lookup_vaddr(page_index);
+    vm_tlbshootdown(&ts);
+
+    return true;
+}
+
+
+// random: start at a random page and take the first swappable one
+static bool random_select(unsigned int* page_index){
+    unsigned int size = get_coremap_size();
+    unsigned int i = random() % size;
+
+    for(unsigned int counter = 0; counter < size; counter++){
+        if(is_swappable(i)){
+            *page_index = i;
+            return true;
+        }
+        i = (i + 1) % size;
+    }
+
+    return false;
+}
+
+const struct page_policy random_policy = {
+    .pp_name = "random",
+    .pp_select = random_select,
+};
+
+
+// clock: referenced pages get a second chance, so we need two sweeps at most
+static bool clock_select(unsigned int* page_index){
+    unsigned int size = get_coremap_size();
+
+    for(unsigned int counter = 0; counter < 2 * size; counter++){
+        unsigned int i = clock_hand;
+        clock_hand = (clock_hand + 1) % size;
+
+        if(!is_swappable(i) || page_referenced(i))
+            continue;
+
+        *page_index = i;
+        return true;
+    }
+
+    return false;
+}
+
+const struct page_policy clock_policy = {
+    .pp_name = "clock",
+    .pp_select = clock_select,
+};
+
+
+// aging (WSClock style): every pass of the hand shifts the referenced bit into
+// the top of the page's age. a page with age 0 was not used during the last
+// eight passes and is outside of the working set, so it is taken right away.
+// otherwise the oldest page seen during one sweep is taken
+#define AGE_BITS 8
+
+static bool aging_select(unsigned int* page_index){
+    unsigned int size = get_coremap_size();
+    unsigned int best_age = (unsigned int) -1;
+    bool found = false;
+
+    for(unsigned int counter = 0; counter < size; counter++){
+        unsigned int i = clock_hand;
+        clock_hand = (clock_hand + 1) % size;
+
+        if(!is_swappable(i))
+            continue;
+
+        unsigned int age = get_age(i) >> 1;
+        if(page_referenced(i))
+            age |= 1 << (AGE_BITS - 1);
+        set_age(i, age);
+
+        if(age == 0){
+            *page_index = i;
+            return true;
+        }
+        if(age < best_age){
+            best_age = age;
+            *page_index = i;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+const struct page_policy aging_policy = {
+    .pp_name = "aging",
+    .pp_select = aging_select,
+};
+
+
+// returns the policy picked by the kernel config
+const struct page_policy* page_policy_get(void){
+#if OPT_PAGERANDOM
+    return &random_policy;
+#elif OPT_PAGEAGING
+    return &aging_policy;
+#else
+    return &clock_policy;
+#endif
+}
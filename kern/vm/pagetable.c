@@ -0,0 +1,301 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pagetable.h>
+
+
+#if OPT_RADIXPT
+
+/*
+ * Radix tree page table. A user address splits into
+ *    PT_ROOT_BITS | PT_MID_BITS | PT_LEAF_BITS | page offset
+ * The root is an array of pointers to mid nodes, a mid node an array
+ * of pointers to leaves and a leaf an array of page table entries.
+ * Missing nodes are NULL.
+ */
+#define PT_LEAF_BITS    6
+#define PT_MID_BITS     6
+#define PT_ROOT_BITS    (32 - 12 - PT_MID_BITS - PT_LEAF_BITS)
+
+#define PT_LEAF_PTES    (1 << PT_LEAF_BITS)
+#define PT_MID_ENTRIES  (1 << PT_MID_BITS)
+#define PT_ROOT_ENTRIES (1 << PT_ROOT_BITS)
+
+#define PT_LEAF_INDEX(va) (((va) >> 12) & (PT_LEAF_PTES - 1))
+#define PT_MID_INDEX(va)  (((va) >> (12 + PT_LEAF_BITS)) & (PT_MID_ENTRIES - 1))
+#define PT_ROOT_INDEX(va) ((va) >> (12 + PT_LEAF_BITS + PT_MID_BITS))
+
+struct pt_leaf {
+	struct page_table_entry pl_ptes[PT_LEAF_PTES];
+	unsigned pl_count;		// valid entries in pl_ptes
+	vaddr_t pl_base;		// user address of pl_ptes[0]
+	struct pt_leaf *pl_next;	// next leaf of the address space
+};
+
+struct pt_mid {
+	struct pt_leaf *pm_leaves[PT_MID_ENTRIES];
+};
+
+int
+pt_create(struct addrspace *as)
+{
+	as->pt_root = kmalloc(PT_ROOT_ENTRIES * sizeof(struct pt_mid *));
+	if (as->pt_root == NULL) {
+		return ENOMEM;
+	}
+	bzero(as->pt_root, PT_ROOT_ENTRIES * sizeof(struct pt_mid *));
+	as->pt_leaves = NULL;
+	return 0;
+}
+
+void
+pt_destroy(struct addrspace *as)
+{
+	struct pt_leaf *leaf;
+	unsigned i;
+
+	while (as->pt_leaves != NULL) {
+		leaf = as->pt_leaves;
+		as->pt_leaves = leaf->pl_next;
+		kfree(leaf);
+	}
+	for (i = 0; i < PT_ROOT_ENTRIES; i++) {
+		if (as->pt_root[i] != NULL) {
+			kfree(as->pt_root[i]);
+		}
+	}
+	kfree(as->pt_root);
+	as->pt_root = NULL;
+}
+
+static
+struct pt_leaf *
+pt_leaf_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct pt_mid *mid = as->pt_root[PT_ROOT_INDEX(vaddr)];
+
+	if (mid == NULL) {
+		return NULL;
+	}
+	return mid->pm_leaves[PT_MID_INDEX(vaddr)];
+}
+
+struct page_table_entry *
+pt_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct pt_leaf *leaf = pt_leaf_lookup(as, vaddr);
+
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return &leaf->pl_ptes[PT_LEAF_INDEX(vaddr)];
+}
+
+/*
+ * New nodes are filled in before they are hooked into the tree, so the
+ * pageout daemon looking up neighbours without our help never sees a
+ * half built one.
+ */
+struct page_table_entry *
+pt_lookup_create(struct addrspace *as, vaddr_t vaddr)
+{
+	struct pt_mid *mid;
+	struct pt_leaf *leaf;
+
+	mid = as->pt_root[PT_ROOT_INDEX(vaddr)];
+	if (mid == NULL) {
+		mid = kmalloc(sizeof(struct pt_mid));
+		if (mid == NULL) {
+			return NULL;
+		}
+		bzero(mid, sizeof(struct pt_mid));
+		as->pt_root[PT_ROOT_INDEX(vaddr)] = mid;
+	}
+
+	leaf = mid->pm_leaves[PT_MID_INDEX(vaddr)];
+	if (leaf == NULL) {
+		leaf = kmalloc(sizeof(struct pt_leaf));
+		if (leaf == NULL) {
+			return NULL;
+		}
+		bzero(leaf, sizeof(struct pt_leaf));
+		leaf->pl_base = vaddr & ~(vaddr_t)((PT_LEAF_PTES << 12) - 1);
+		leaf->pl_next = as->pt_leaves;
+		as->pt_leaves = leaf;
+		mid->pm_leaves[PT_MID_INDEX(vaddr)] = leaf;
+	}
+
+	return &leaf->pl_ptes[PT_LEAF_INDEX(vaddr)];
+}
+
+void
+pt_set_valid(struct addrspace *as, vaddr_t vaddr,
+	     struct page_table_entry *pte, bool valid)
+{
+	struct pt_leaf *leaf = pt_leaf_lookup(as, vaddr);
+
+	KASSERT(leaf != NULL);
+	KASSERT(pte == &leaf->pl_ptes[PT_LEAF_INDEX(vaddr)]);
+
+	if (pte->valid == valid) {
+		return;
+	}
+	pte->valid = valid;
+	if (valid) {
+		leaf->pl_count++;
+	}
+	else {
+		KASSERT(leaf->pl_count > 0);
+		leaf->pl_count--;
+	}
+}
+
+void
+pt_iter_init(struct pt_iter *it, struct addrspace *as)
+{
+	it->pi_as = as;
+	it->pi_leaf = as->pt_leaves;
+	it->pi_index = 0;
+}
+
+/*
+ * Leaves without valid entries are skipped as a whole. Only the owner
+ * of the address space adds valid entries, so a count of zero can be
+ * trusted while the owner walks its own table.
+ */
+struct page_table_entry *
+pt_iter_next(struct pt_iter *it, vaddr_t *vaddr)
+{
+	struct page_table_entry *pte;
+
+	while (it->pi_leaf != NULL) {
+		if (it->pi_leaf->pl_count == 0) {
+			it->pi_leaf = it->pi_leaf->pl_next;
+			it->pi_index = 0;
+			continue;
+		}
+		while (it->pi_index < PT_LEAF_PTES) {
+			pte = &it->pi_leaf->pl_ptes[it->pi_index];
+			*vaddr = it->pi_leaf->pl_base + ((vaddr_t)it->pi_index << 12);
+			it->pi_index++;
+			if (pte->valid) {
+				return pte;
+			}
+		}
+		it->pi_leaf = it->pi_leaf->pl_next;
+		it->pi_index = 0;
+	}
+	return NULL;
+}
+
+#else /* OPT_RADIXPT */
+
+/*
+ * Two-level page table. The first level is a page of 1024 entries
+ * indexed by the top ten bits of the address. A valid one holds the
+ * kernel page number of a second level page, which holds the page table
+ * entries of the 1024 pages of that 4MB.
+ */
+#define PT_L1_INDEX(va) ((va) >> 22)
+#define PT_L2_INDEX(va) (((va) >> 12) & 1023)
+#define PT_L2(l1)       ((struct page_table_entry *)((vaddr_t)(l1).index << 12))
+
+int
+pt_create(struct addrspace *as)
+{
+	as->page_table = (struct page_table_entry *)alloc_kpages(1);
+	if (as->page_table == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+void
+pt_destroy(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i = 0; i < 1024; i++) {
+		if (as->page_table[i].valid) {
+			free_kpages((vaddr_t)PT_L2(as->page_table[i]));
+		}
+	}
+	free_kpages((vaddr_t)as->page_table);
+	as->page_table = NULL;
+}
+
+struct page_table_entry *
+pt_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct page_table_entry l1 = as->page_table[PT_L1_INDEX(vaddr)];
+
+	if (!l1.valid) {
+		return NULL;
+	}
+	return &PT_L2(l1)[PT_L2_INDEX(vaddr)];
+}
+
+struct page_table_entry *
+pt_lookup_create(struct addrspace *as, vaddr_t vaddr)
+{
+	struct page_table_entry *l1 = &as->page_table[PT_L1_INDEX(vaddr)];
+
+	if (!l1->valid) {
+		//second level pages come zeroed, all their entries invalid
+		vaddr_t addr = vm_alloc_page();
+		if (!addr) {
+			return NULL;
+		}
+		l1->index = addr >> 12;
+		l1->valid = 1;
+	}
+	return &PT_L2(*l1)[PT_L2_INDEX(vaddr)];
+}
+
+void
+pt_set_valid(struct addrspace *as, vaddr_t vaddr,
+	     struct page_table_entry *pte, bool valid)
+{
+	(void)as;
+	(void)vaddr;
+
+	pte->valid = valid;
+}
+
+void
+pt_iter_init(struct pt_iter *it, struct addrspace *as)
+{
+	it->pi_as = as;
+	it->pi_l1 = 0;
+	it->pi_index = 0;
+}
+
+struct page_table_entry *
+pt_iter_next(struct pt_iter *it, vaddr_t *vaddr)
+{
+	struct page_table_entry *l1, *pte;
+
+	while (it->pi_l1 < 1024) {
+		l1 = &it->pi_as->page_table[it->pi_l1];
+		if (!l1->valid) {
+			it->pi_l1++;
+			it->pi_index = 0;
+			continue;
+		}
+		while (it->pi_index < 1024) {
+			pte = &PT_L2(*l1)[it->pi_index];
+			*vaddr = ((vaddr_t)it->pi_l1 << 22) | ((vaddr_t)it->pi_index << 12);
+			it->pi_index++;
+			if (pte->valid) {
+				return pte;
+			}
+		}
+		it->pi_l1++;
+		it->pi_index = 0;
+	}
+	return NULL;
+}
+
+#endif /* OPT_RADIXPT */
@@ -0,0 +1,47 @@
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <coremap.h>
+#include <vmstat.h>
+
+// events counted before there is a cpu to count them on
+static uint32_t vmstat_boot[VMS_NCOUNTERS];
+
+void vmstat_add(unsigned counter, uint32_t n){
+    int spl;
+
+    KASSERT(counter < VMS_NCOUNTERS);
+
+    if(!CURCPU_EXISTS() || curcpu == NULL){
+        vmstat_boot[counter] += n;
+        return;
+    }
+    spl = splhigh();
+    curcpu->c_self->c_vmstat[counter] += n;
+    splx(spl);
+}
+
+void vmstat_inc(unsigned counter){
+    vmstat_add(counter, 1);
+}
+
+// the counters of other cpus may move while we add them up, which
+// is fine for statistics
+void vmstat_get(struct vmstat *vs){
+    struct cpu *c;
+    unsigned i, j;
+
+    for(j = 0; j < VMS_NCOUNTERS; j++)
+        vs->vs_counters[j] = vmstat_boot[j];
+    for(i = 0; i < cpu_count(); i++){
+        c = cpu_get(i);
+        for(j = 0; j < VMS_NCOUNTERS; j++)
+            vs->vs_counters[j] += c->c_vmstat[j];
+    }
+
+    vs->vs_pages = get_coremap_size();
+    vs->vs_free = get_free_page_count();
+    vs->vs_free_low = get_free_page_low();
+}
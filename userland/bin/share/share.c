@@ -0,0 +1,54 @@
+#include <sys/types.h>
+#include <sys/sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * share - give processes a share of the cpu.
+ * Usage: share tickets program [args...]
+ *        share -p pid [tickets]
+ *
+ * The first form runs the program in the stride scheduling class with
+ * TICKETS tickets; the default class as a whole holds 100, so 100
+ * tickets get about as much of a cpu as all other threads together.
+ * 0 tickets mean the default class. The second form prints or sets
+ * the tickets of a running process.
+ */
+
+int
+main(int argc, char *argv[])
+{
+	unsigned tickets;
+	pid_t pid;
+
+	if (argc >= 3 && argv[1][0] == '-' && argv[1][1] == 'p') {
+		pid = atoi(argv[2]);
+		if (argc > 3) {
+			if (sched_settickets(pid, atoi(argv[3])) < 0) {
+				err(1, "sched_settickets");
+			}
+		}
+		if (sched_gettickets(pid, &tickets) < 0) {
+			err(1, "sched_gettickets");
+		}
+		if (tickets == 0) {
+			printf("pid %d: default class\n", pid);
+		}
+		else {
+			printf("pid %d: %u tickets\n", pid, tickets);
+		}
+		return 0;
+	}
+
+	if (argc < 3) {
+		errx(1, "Usage: share tickets program [args...] | "
+		     "share -p pid [tickets]");
+	}
+	if (sched_settickets(0, atoi(argv[1])) < 0) {
+		err(1, "sched_settickets");
+	}
+	execv(argv[2], &argv[2]);
+	err(1, "%s", argv[2]);
+}
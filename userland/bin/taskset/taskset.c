@@ -0,0 +1,75 @@
+#include <sys/types.h>
+#include <sys/sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * taskset - pin processes to cpus.
+ * Usage: taskset mask program [args...]
+ *        taskset -p pid [mask]
+ *
+ * The first form runs the program on the cpus in MASK, a bit per cpu
+ * number, e.g. 0x2 for cpu 1 only. The second prints or sets the
+ * cpus of a running process.
+ */
+
+static
+unsigned
+getmask(const char *s)
+{
+	unsigned mask = 0;
+	int digit;
+
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		for (s += 2; *s; s++) {
+			if (*s >= '0' && *s <= '9') {
+				digit = *s - '0';
+			}
+			else if (*s >= 'a' && *s <= 'f') {
+				digit = *s - 'a' + 10;
+			}
+			else if (*s >= 'A' && *s <= 'F') {
+				digit = *s - 'A' + 10;
+			}
+			else {
+				errx(1, "bad mask");
+			}
+			mask = mask * 16 + digit;
+		}
+		return mask;
+	}
+	return atoi(s);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned mask;
+	pid_t pid;
+
+	if (argc >= 3 && argv[1][0] == '-' && argv[1][1] == 'p') {
+		pid = atoi(argv[2]);
+		if (argc > 3) {
+			if (sched_setaffinity(pid, getmask(argv[3])) < 0) {
+				err(1, "sched_setaffinity");
+			}
+		}
+		if (sched_getaffinity(pid, &mask) < 0) {
+			err(1, "sched_getaffinity");
+		}
+		printf("pid %d: cpus 0x%x\n", pid, mask);
+		return 0;
+	}
+
+	if (argc < 3) {
+		errx(1, "Usage: taskset mask program [args...] | "
+		     "taskset -p pid [mask]");
+	}
+	if (sched_setaffinity(0, getmask(argv[1])) < 0) {
+		err(1, "sched_setaffinity");
+	}
+	execv(argv[2], &argv[2]);
+	err(1, "%s", argv[2]);
+}
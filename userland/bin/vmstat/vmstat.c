@@ -0,0 +1,87 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/vmstat.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * vmstat - print virtual memory statistics.
+ * Usage: vmstat [program [args...]]
+ *
+ * Without arguments, prints the counters since boot. With a program,
+ * runs it and prints what the system counted while it ran.
+ */
+
+static const char *const names[VMS_NCOUNTERS] = {
+	[VMS_TLB_READ]         = "tlb misses on loads",
+	[VMS_TLB_WRITE]        = "tlb misses on stores",
+	[VMS_TLB_READONLY]     = "stores to read-only pages",
+	[VMS_TLB_REFILL]       = "  handled by the refill fast path",
+	[VMS_TLB_LPAGE]        = "tlb entries loaded with their large page",
+	[VMS_FAULT_ZEROFILL]   = "zero-fill faults",
+	[VMS_FAULT_ZEROPAGE]   = "reads mapped to the zero frame",
+	[VMS_FAULT_FILE]       = "pages read from files",
+	[VMS_FAULT_CACHED]     = "page cache hits",
+	[VMS_FAULT_SWAPIN]     = "swap-in faults",
+	[VMS_FAULT_AHEAD]      = "  pages read ahead",
+	[VMS_FAULT_LPAGE]      = "pages mapped with their large page",
+	[VMS_FAULT_COW]        = "copy-on-write faults",
+	[VMS_FAULT_ZEROBREAK]  = "first writes to zero frame pages",
+	[VMS_EVICT]            = "pages evicted",
+	[VMS_EVICT_FILE]       = "  file pages among them",
+	[VMS_CLEAN]            = "pages cleaned ahead of eviction",
+	[VMS_SWAP_READ]        = "swap pages read",
+	[VMS_SWAP_WRITE]       = "swap pages written",
+	[VMS_CMLOCK]           = "coremap lock acquisitions",
+	[VMS_CMLOCK_CONTENDED] = "  contended",
+	[VMS_ALLOC_WAIT]       = "waits for memory",
+	[VMS_OOM_KILL]         = "processes killed for memory",
+};
+
+static
+void
+getstats(struct vmstat *vs)
+{
+	if (__vmstat(vs) < 0) {
+		err(1, "__vmstat");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct vmstat before, after;
+	int i, status;
+	pid_t pid;
+
+	getstats(&before);
+	if (argc > 1) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			execv(argv[1], &argv[1]);
+			err(1, "%s", argv[1]);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		getstats(&after);
+		for (i = 0; i < VMS_NCOUNTERS; i++) {
+			after.vs_counters[i] -= before.vs_counters[i];
+		}
+	}
+	else {
+		after = before;
+	}
+
+	for (i = 0; i < VMS_NCOUNTERS; i++) {
+		printf("%10u %s\n", after.vs_counters[i], names[i]);
+	}
+	printf("%10u pages of memory\n", after.vs_pages);
+	printf("%10u free\n", after.vs_free);
+	printf("%10u free at the lowest\n", after.vs_free_low);
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_ and MAP_ #defines from the kernel
+ */
+#include <kern/mman.h>
+
+/*
+ * Map LEN bytes of the file FD from OFFSET (a multiple of the page
+ * size), or zero-filled memory with MAP_ANON, somewhere into the
+ * address space. ADDR is ignored. Pages are read in when first used.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,31 @@
+#ifndef _SYS_SCHED_H_
+#define _SYS_SCHED_H_
+
+#include <sys/types.h>
+
+/*
+ * Restrict process PID, 0 for the calling one, to the cpus in MASK,
+ * a bit per cpu number. Children inherit the mask.
+ */
+int sched_setaffinity(pid_t pid, unsigned mask);
+
+/*
+ * Get the cpus process PID may run on.
+ */
+int sched_getaffinity(pid_t pid, unsigned *mask);
+
+/*
+ * Give process PID, 0 for the calling one, TICKETS tickets in the
+ * stride scheduling class, where it gets a share of a cpu in
+ * proportion to its tickets; the default class as a whole holds 100.
+ * Zero tickets put it back in the default class. Children inherit the
+ * tickets.
+ */
+int sched_settickets(pid_t pid, unsigned tickets);
+
+/*
+ * Get the tickets of process PID, 0 if it is in the default class.
+ */
+int sched_gettickets(pid_t pid, unsigned *tickets);
+
+#endif /* _SYS_SCHED_H_ */
@@ -0,0 +1,16 @@
+#ifndef _SYS_VMSTAT_H_
+#define _SYS_VMSTAT_H_
+
+#include <sys/types.h>
+
+/*
+ * Get struct vmstat and the VMS_ counter indexes from the kernel
+ */
+#include <kern/vmstat.h>
+
+/*
+ * Fill in VS with the kernel's VM statistics.
+ */
+int __vmstat(struct vmstat *vs);
+
+#endif /* _SYS_VMSTAT_H_ */
@@ -0,0 +1,139 @@
+/*
+ * a3_mmap.c
+ *
+ * 	Tests mmap and munmap: anonymous memory, a region split by munmap,
+ * 	a private and a shared mapping of a file, and a shared mapping
+ * 	written by a forked child.
+ *
+ * Usage: a3_mmap [file]
+ * The file (default mmaptest.dat) is created and overwritten.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PAGE 4096
+#define FILESIZE (2 * PAGE + PAGE / 2)
+
+static char buf[FILESIZE];
+
+static
+void
+anon(void)
+{
+	char *p;
+	int i;
+
+	p = mmap(NULL, 4 * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap anonymous");
+	}
+	for (i = 0; i < 4 * PAGE; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous memory not zero at %d", i);
+		}
+		p[i] = (char)i;
+	}
+
+	/* punch a hole into the middle, the rest has to stay */
+	if (munmap(p + PAGE, PAGE)) {
+		err(1, "munmap");
+	}
+	for (i = 0; i < 4 * PAGE; i++) {
+		if (i >= PAGE && i < 2 * PAGE) {
+			continue;
+		}
+		if (p[i] != (char)i) {
+			errx(1, "anonymous memory changed at %d", i);
+		}
+	}
+	if (munmap(p, 4 * PAGE)) {
+		err(1, "munmap");
+	}
+	printf("anonymous: passed\n");
+}
+
+static
+void
+file(const char *name)
+{
+	char *p, *q;
+	int fd, i, status;
+	pid_t pid;
+
+	for (i = 0; i < FILESIZE; i++) {
+		buf[i] = 'a' + i % 26;
+	}
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", name);
+	}
+
+	/* private: what we see is the file, past its end zeros */
+	p = mmap(NULL, 3 * PAGE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+	if (memcmp(p, buf, FILESIZE)) {
+		errx(1, "private mapping differs from the file");
+	}
+	for (i = FILESIZE; i < 3 * PAGE; i++) {
+		if (p[i] != 0) {
+			errx(1, "private mapping not zero past the end of the file");
+		}
+	}
+
+	/* shared: a forked child writes, the parent and the file see it */
+	q = mmap(NULL, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (q == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	q[0] = 'X';
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		q[PAGE + 1] = 'Y';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (q[0] != 'X' || q[PAGE + 1] != 'Y') {
+		errx(1, "shared mapping did not see the writes");
+	}
+	if (munmap(q, FILESIZE) || munmap(p, 3 * PAGE)) {
+		err(1, "munmap");
+	}
+	close(fd);
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	if (read(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: read", name);
+	}
+	if (buf[0] != 'X' || buf[PAGE + 1] != 'Y' || buf[1] != 'b') {
+		errx(1, "the writes did not make it to the file");
+	}
+	close(fd);
+	printf("file: passed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	anon();
+	file(argc > 1 ? argv[1] : "mmaptest.dat");
+	return 0;
+}